@@ -0,0 +1,193 @@
+/*
+Event backend benchmark: checks per second and worker syscalls per check for
+the epoll backend, level and edge triggered, and the io_uring backend, against
+the keepalive mock server.
+
+A worker runs on its own thread and a driver keeps depth checks in flight per
+target over the worker socket. With one, every check is a request on a pooled
+keepalive connection once the pools are warm; with more, and the pool held to
+one connection, the run also compares pipelining them on that connection
+against opening new ones. Syscalls are those the worker makes on check sockets
+plus its waits, the poller side is not counted.
+
+Before the runs, a request sent on a reused connection is checked to leave the
+handshake round trip estimate of its target alone, as the adaptive timeouts of
+new connections depend on it.
+
+	bench/bench_backend [targets] [seconds] [depth]
+*/
+#include "../zabbix_http_check_keepalive.cpp"
+#include "mock_server.h"
+
+static void* worker_run(void* arg){
+	main_thread((int)(intptr_t)arg);
+	return NULL;
+}
+
+static double elapsed(const struct timespec& start){
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static uint64_t syscalls(){
+	return counters.epoll_wait + counters.epoll_ctl + counters.uring_enter + counters.socket +
+		counters.connect + counters.send + counters.recv + counters.close;
+}
+
+// build the check payload for target i, 127.0.0.1 upwards
+static uint16_t target_payload(char* payload, int i, int port){
+	int len = sprintf(payload, "127.0.%d.%d", (i + 1) / 256, (i + 1) % 256) + 1;
+	return len + sprintf(payload + len, "%d", port) + 1;
+}
+
+// send a request on a pooled connection and record it, true if the connect estimate is unchanged
+static bool check_reuse_rtt(){
+	hck_handle hck;
+	struct hck_addr addr;
+	struct hck_target* t;
+	struct hck_details* h;
+	struct hck_rtt before;
+	char buf[256];
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1){
+		return false;
+	}
+	hck.edge = true;
+	addr_parse("127.0.0.1", "80", &addr);
+	t = target_get(&hck, addr, spec_get(&hck, "HEAD", "/", "127.0.0.1", 1), 1);
+	t->connect_rtt.srtt = 80000;
+	t->connect_rtt.rttvar = 20000;
+	before = t->connect_rtt;
+
+	h = hck.slab.alloc();
+	memset(h, 0, sizeof(*h));
+	h->target = t;
+	h->remote_socket = sv[0];
+	h->state = hck_details::writing;
+	h->first = false;
+	timing_start(&hck, h);
+	http_send(&hck, h);
+	recv(sv[1], buf, sizeof(buf), 0);
+	timing_mark(&hck, h, PHASE_READ);
+	timing_mark(&hck, h, PHASE_HEADER);
+	latency_record(&hck, h, 1);
+
+	close(sv[0]);
+	close(sv[1]);
+	return memcmp(&before, &t->connect_rtt, sizeof(before)) == 0;
+}
+
+static void run(const char* name, int backend, bool edge, int pipeline, int worker, int targets, int depth, double seconds, int port){
+	pthread_t thread;
+	struct timespec start;
+	struct hck_frame f;
+	char payload[64];
+	uint16_t result;
+	long done = 0, failed = 0;
+	uint64_t before, checks, waits, events, connects;
+	int fd;
+
+	config.backend = backend;
+	config.edge_triggered = edge;
+	config.pipeline = pipeline;
+	memset(&counters, 0, sizeof(counters));
+	running = 1;
+	pthread_create(&thread, NULL, worker_run, (void*)(intptr_t)worker);
+	usleep(100000);
+
+	fd = worker_fd(worker);
+	if (fd == -1){
+		fprintf(stderr, "unable to reach the worker\n");
+		exit(1);
+	}
+
+	/* Warm up: open a connection to every target */
+	for (int i = 0; i < targets; i++){
+		send_frame(fd, HCK_MSG_CHECK, i * depth, payload, target_payload(payload, i, port));
+	}
+	for (int i = 0; i < targets; i++){
+		recv_frame(fd, &f, &result, sizeof(result));
+	}
+
+	before = syscalls();
+	checks = counters.checks;
+	waits = counters.waits;
+	events = counters.epoll_events + counters.completions;
+	connects = counters.socket;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < targets * depth; i++){
+		send_frame(fd, HCK_MSG_CHECK, i, payload, target_payload(payload, i / depth, port));
+	}
+	while (elapsed(start) < seconds){
+		if (!recv_frame(fd, &f, &result, sizeof(result))){
+			fprintf(stderr, "worker connection lost\n");
+			exit(1);
+		}
+		if (result == HCK_RESULT_OK){
+			done++;
+		}
+		else{
+			failed++;
+		}
+		send_frame(fd, HCK_MSG_CHECK, f.id, payload, target_payload(payload, f.id / depth, port));
+	}
+	double secs = elapsed(start);
+	uint64_t calls = syscalls() - before;
+	checks = counters.checks - checks;
+	waits = counters.waits - waits;
+	events = counters.epoll_events + counters.completions - events;
+	connects = counters.socket - connects;
+
+	printf("%-20s %10.0f checks/s %6.2f syscalls/check %7.1f events/wait %6.3f connects/check (%ld failed)%s\n",
+		name, done / secs, checks ? (double)calls / checks : 0.0, waits ? (double)events / waits : 0.0,
+		checks ? (double)connects / checks : 0.0, failed,
+		backend == BACKEND_URING && counters.uring_enter == 0 ? " - io_uring unavailable, ran on epoll" : "");
+
+	/* Collect the checks still in flight, then stop the worker, a connection to its listener wakes it up */
+	for (int i = 1; i < targets * depth; i++){
+		recv_frame(fd, &f, &result, sizeof(result));
+	}
+	running = 0;
+	close(connect_to_hck(worker));
+	pthread_join(thread, NULL);
+	worker_reset(worker);
+}
+
+int main(int argc, char** argv){
+	int targets = argc > 1 ? atoi(argv[1]) : 256;
+	double seconds = argc > 2 ? atof(argv[2]) : 3;
+	int depth = argc > 3 ? max(1, atoi(argv[3])) : 1;
+	mock_server server;
+
+	for (int i = 0; i < HCK_MAX_WORKERS; i++){
+		hck_fds[i] = -1;
+	}
+	config.coalesce = false;
+	config.keepalive_max = 1;
+
+	if (!server.start()){
+		return 1;
+	}
+	printf("%d targets, %d checks in flight per target, %.0f seconds per run\n", targets, depth, seconds);
+	printf("reused request leaves the connect estimate: %s\n", check_reuse_rtt() ? "ok" : "MISMATCH");
+
+	run("epoll level", BACKEND_EPOLL, false, PIPELINE_MAX, 0, targets, depth, seconds, server.port);
+	run("epoll edge", BACKEND_EPOLL, true, PIPELINE_MAX, 1, targets, depth, seconds, server.port);
+#ifdef HCK_IO_URING
+	run("io_uring", BACKEND_URING, false, PIPELINE_MAX, 2, targets, depth, seconds, server.port);
+#else
+	printf("io_uring             not built\n");
+#endif
+	if (depth > 1){
+		run("epoll edge, no pipe", BACKEND_EPOLL, true, 1, 3, targets, depth, seconds, server.port);
+#ifdef HCK_IO_URING
+		run("io_uring, no pipe", BACKEND_URING, false, 1, 4, targets, depth, seconds, server.port);
+#endif
+	}
+
+	server.stop();
+	return 0;
+}
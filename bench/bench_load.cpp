@@ -0,0 +1,264 @@
+/*
+End to end load benchmark: worker processes running main_thread, the mock
+server standing in for the checked hosts, and a load generator driving the
+worker socket protocol the way the pollers do, all without zabbix.
+
+A driver thread per worker keeps a number of checks in flight per target and
+times each one from its request to its result. The run reports checks per
+second, latency percentiles, the keepalive hit rate from the workers'
+counters, and the workers' memory.
+
+	bench/bench_load [options]
+	-t targets     targets checked, 127.0.0.1 upwards (256)
+	-c depth       checks in flight per target (1)
+	-s seconds     length of the run (5)
+	-w workers     worker processes (1)
+	-b backend     epoll, edge or io_uring (edge)
+	-l ms          server latency, each response held back this long (0)
+	-k requests    responses per server connection before it is closed, 0 for no limit (0)
+	-e percent     requests the server answers with a 503 (0)
+	-r percent     requests the server answers by resetting the connection (0)
+*/
+#include "../zabbix_http_check_keepalive.cpp"
+#include "mock_server.h"
+
+#include <sys/wait.h>
+
+struct driver {
+	int worker;
+	int depth;
+	int port;
+	double seconds;
+	vector<int> targets;	// served by this worker
+	vector<uint64_t> latency;	// ns, a sample per check
+	long done;
+	long failed;
+	pthread_t thread;
+};
+
+// the drivers wait on it after the warm up, twice, so the counters can be read in between
+static pthread_barrier_t warm;
+
+static double elapsed(const struct timespec& start){
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void target_addr(char* addr, int i){
+	sprintf(addr, "127.0.%d.%d", (i + 1) / 256, (i + 1) % 256);
+}
+
+// build the check payload for target i
+static uint16_t target_payload(char* payload, int i, int port){
+	target_addr(payload, i);
+	int len = strlen(payload) + 1;
+	return len + sprintf(payload + len, "%d", port) + 1;
+}
+
+static void* driver_run(void* arg){
+	struct driver* d = (struct driver*)arg;
+	int n = d->targets.size() * d->depth;
+	vector<uint64_t> sent(n);
+	struct timespec start;
+	struct hck_frame f;
+	char payload[64];
+	uint16_t result;
+	int fd;
+
+	/* Warm up: open a connection to every target */
+	fd = connect_to_hck(d->worker);
+	for (size_t i = 0; fd != -1 && i < d->targets.size(); i++){
+		send_frame(fd, HCK_MSG_CHECK, i, payload, target_payload(payload, d->targets[i], d->port));
+	}
+	for (size_t i = 0; fd != -1 && i < d->targets.size(); i++){
+		recv_frame(fd, &f, &result, sizeof(result));
+	}
+	pthread_barrier_wait(&warm);
+	pthread_barrier_wait(&warm);
+	if (fd == -1){
+		fprintf(stderr, "unable to reach worker #%d\n", d->worker + 1);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < n; i++){
+		sent[i] = monotonic_ns();
+		send_frame(fd, HCK_MSG_CHECK, i, payload, target_payload(payload, d->targets[i / d->depth], d->port));
+	}
+	while (elapsed(start) < d->seconds){
+		if (!recv_frame(fd, &f, &result, sizeof(result)) || f.id >= (uint32_t)n){
+			fprintf(stderr, "worker #%d connection lost\n", d->worker + 1);
+			break;
+		}
+		uint64_t now = monotonic_ns();
+		d->latency.push_back(now - sent[f.id]);
+		if (result == HCK_RESULT_OK){
+			d->done++;
+		}
+		else{
+			d->failed++;
+		}
+		sent[f.id] = now;
+		send_frame(fd, HCK_MSG_CHECK, f.id, payload, target_payload(payload, d->targets[f.id / d->depth], d->port));
+	}
+
+	/* The checks still in flight are dropped with the workers */
+	close(fd);
+	return NULL;
+}
+
+// a worker metric summed over the workers, 0 if unavailable
+static uint64_t stat(const char* metric){
+	uint64_t value;
+	return execute_stats(metric, "", &value) == HCK_RESULT_OK ? value : 0;
+}
+
+// resident and peak resident kB of a process
+static void memory(pid_t pid, long* rss, long* hwm){
+	char path[64], line[256];
+	FILE* fp;
+
+	*rss = *hwm = 0;
+	sprintf(path, "/proc/%d/status", (int)pid);
+	if ((fp = fopen(path, "r")) == NULL){
+		return;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL){
+		sscanf(line, "VmRSS: %ld", rss);
+		sscanf(line, "VmHWM: %ld", hwm);
+	}
+	fclose(fp);
+}
+
+static double percentile(const vector<uint64_t>& sorted, double q){
+	if (sorted.empty()){
+		return 0;
+	}
+	return sorted[min(sorted.size() - 1, (size_t)(q * sorted.size()))] / 1e3;
+}
+
+int main(int argc, char** argv){
+	int targets = 256, depth = 1, workers = 1;
+	double seconds = 5;
+	const char* backend = "edge";
+	vector<pid_t> pids;
+	vector<struct driver*> drivers;
+	vector<uint64_t> latency;
+	mock_server server;
+	char addr[32], port[8];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:c:s:w:b:l:k:e:r:")) != -1){
+		switch (opt){
+		case 't': targets = max(1, atoi(optarg)); break;
+		case 'c': depth = max(1, atoi(optarg)); break;
+		case 's': seconds = atof(optarg); break;
+		case 'w': workers = min(max(1, atoi(optarg)), HCK_MAX_WORKERS); break;
+		case 'b': backend = optarg; break;
+		case 'l': server.delay = atoi(optarg); break;
+		case 'k': server.max_requests = atoi(optarg); break;
+		case 'e': server.error_rate = atoi(optarg); break;
+		case 'r': server.reset_rate = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-t targets] [-c depth] [-s seconds] [-w workers] [-b epoll|edge|io_uring] "
+				"[-l ms] [-k requests] [-e percent] [-r percent]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	config.workers = workers;
+	config.backend = strcmp(backend, "io_uring") == 0 ? BACKEND_URING : BACKEND_EPOLL;
+	config.edge_triggered = strcmp(backend, "edge") == 0;
+	config.coalesce = false;
+	for (int i = 0; i < HCK_MAX_WORKERS; i++){
+		hck_fds[i] = -1;
+	}
+
+	/* Workers first, so they do not inherit the server thread */
+	for (int i = 0; i < workers; i++){
+		pid_t pid = fork();
+		if (pid == 0){
+			prctl(PR_SET_PDEATHSIG, SIGKILL);
+			main_thread(i);
+			exit(0);
+		}
+		pids.push_back(pid);
+	}
+	if (!server.start()){
+		return 1;
+	}
+	usleep(200000);
+
+	printf("%d targets, %d checks in flight per target, %d workers on %s, %.0f seconds\n",
+		targets, depth, workers, backend, seconds);
+	printf("server: %d ms latency, %d requests per connection, %d%% errors, %d%% resets\n",
+		server.delay, server.max_requests, server.error_rate, server.reset_rate);
+
+	/* Targets go to the worker that serves them */
+	sprintf(port, "%d", server.port);
+	for (int i = 0; i < workers; i++){
+		struct driver* d = new struct driver();
+		d->worker = i;
+		d->depth = depth;
+		d->port = server.port;
+		d->seconds = seconds;
+		drivers.push_back(d);
+	}
+	for (int i = 0; i < targets; i++){
+		target_addr(addr, i);
+		drivers[worker_for(addr, port)]->targets.push_back(i);
+	}
+
+	int active = 0;
+	for (size_t i = 0; i < drivers.size(); i++){
+		active += !drivers[i]->targets.empty();
+	}
+	pthread_barrier_init(&warm, NULL, active + 1);
+	for (size_t i = 0; i < drivers.size(); i++){
+		if (!drivers[i]->targets.empty()){
+			pthread_create(&drivers[i]->thread, NULL, driver_run, drivers[i]);
+		}
+	}
+
+	pthread_barrier_wait(&warm);
+	uint64_t hits = stat("keepalive.hits"), misses = stat("keepalive.misses");
+	uint64_t pipelined = stat("checks.pipelined"), expired = stat("checks.expired");
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_barrier_wait(&warm);
+	long done = 0, failed = 0;
+	for (size_t i = 0; i < drivers.size(); i++){
+		if (!drivers[i]->targets.empty()){
+			pthread_join(drivers[i]->thread, NULL);
+		}
+		done += drivers[i]->done;
+		failed += drivers[i]->failed;
+		latency.insert(latency.end(), drivers[i]->latency.begin(), drivers[i]->latency.end());
+	}
+	double secs = elapsed(start);
+	hits = stat("keepalive.hits") - hits;
+	misses = stat("keepalive.misses") - misses;
+	sort(latency.begin(), latency.end());
+
+	printf("%10.0f checks/s (%ld ok, %ld failed)\n", (done + failed) / secs, done, failed);
+	printf("latency    p50 %8.1f us  p99 %8.1f us  p999 %8.1f us  max %8.1f us\n",
+		percentile(latency, 0.5), percentile(latency, 0.99), percentile(latency, 0.999),
+		latency.empty() ? 0.0 : latency.back() / 1e3);
+	printf("keepalive  %5.1f%% hits, %llu new connections, %llu pipelined, %llu expired\n",
+		hits + misses ? 100.0 * hits / (hits + misses) : 0.0, (unsigned long long)misses,
+		(unsigned long long)(stat("checks.pipelined") - pipelined), (unsigned long long)(stat("checks.expired") - expired));
+	for (int i = 0; i < workers; i++){
+		long rss, hwm;
+		memory(pids[i], &rss, &hwm);
+		printf("worker #%d  %ld kB resident, %ld kB peak, %zu targets\n", i + 1, rss, hwm, drivers[i]->targets.size());
+	}
+
+	for (int i = 0; i < workers; i++){
+		kill(pids[i], SIGKILL);
+		waitpid(pids[i], NULL, 0);
+		delete drivers[i];
+	}
+	server.stop();
+	return 0;
+}
@@ -0,0 +1,187 @@
+/*
+Response parser benchmark: the byte at a time newline counter the engine used
+before against resp_parse, over realistic response headers. Each response is
+also parsed split at every possible point, which must give the same result as
+parsing it whole. NUL bytes inside a header name or value, which a peer can
+send, are checked the same way.
+
+	bench/bench_parser [iterations]
+*/
+#include "../zabbix_http_check_keepalive.cpp"
+
+static const char* responses[][2] = {
+	{ "small", "HTTP/1.1 200 OK\r\n"
+		"Server: nginx\r\n"
+		"Date: Mon, 12 Oct 2026 09:14:02 GMT\r\n"
+		"Content-Type: text/html\r\n"
+		"Content-Length: 612\r\n"
+		"Connection: keep-alive\r\n"
+		"\r\n" },
+	{ "medium", "HTTP/1.1 301 Moved Permanently\r\n"
+		"Date: Mon, 12 Oct 2026 09:14:02 GMT\r\n"
+		"Content-Type: text/html; charset=utf-8\r\n"
+		"Content-Length: 162\r\n"
+		"Connection: keep-alive\r\n"
+		"Location: https://www.example.com/\r\n"
+		"Cache-Control: private, no-cache, no-store, must-revalidate, max-age=0\r\n"
+		"Strict-Transport-Security: max-age=31536000; includeSubDomains; preload\r\n"
+		"X-Content-Type-Options: nosniff\r\n"
+		"X-Frame-Options: SAMEORIGIN\r\n"
+		"Referrer-Policy: strict-origin-when-cross-origin\r\n"
+		"Set-Cookie: session=8f14e45fceea167a5a36dedd4bea2543; Path=/; HttpOnly; Secure; SameSite=Lax\r\n"
+		"Vary: Accept-Encoding\r\n"
+		"\r\n" },
+	{ "large", "HTTP/1.1 200 OK\r\n"
+		"Date: Mon, 12 Oct 2026 09:14:02 GMT\r\n"
+		"Content-Type: text/html; charset=UTF-8\r\n"
+		"Content-Length: 48213\r\n"
+		"Connection: close\r\n"
+		"Cache-Control: public, max-age=300, s-maxage=600, stale-while-revalidate=60\r\n"
+		"Content-Security-Policy: default-src 'self'; script-src 'self' 'unsafe-inline' https://cdn.example.com https://www.googletagmanager.com; style-src 'self' 'unsafe-inline' https://fonts.googleapis.com; img-src 'self' data: https:; font-src 'self' https://fonts.gstatic.com; connect-src 'self' https://api.example.com; frame-ancestors 'none'\r\n"
+		"Strict-Transport-Security: max-age=63072000; includeSubDomains; preload\r\n"
+		"Permissions-Policy: geolocation=(), microphone=(), camera=(), payment=(), usb=()\r\n"
+		"X-Content-Type-Options: nosniff\r\n"
+		"X-Frame-Options: DENY\r\n"
+		"X-XSS-Protection: 0\r\n"
+		"Set-Cookie: __cf_bm=Zx9q1b2c3d4e5f6g7h8i9j0k1l2m3n4o5p6q7r8s9t0u1v2w3x4y5z6-1760260442-1.0.1.1-AbCdEfGhIjKlMnOpQrStUvWxYz0123456789; path=/; expires=Mon, 12-Oct-26 09:44:02 GMT; domain=.example.com; HttpOnly; Secure; SameSite=None\r\n"
+		"Set-Cookie: visitor=5d41402abc4b2a76b9719d911017c592; Max-Age=31536000; Path=/; Secure\r\n"
+		"Vary: Accept-Encoding, Cookie\r\n"
+		"Age: 42\r\n"
+		"Accept-Ranges: bytes\r\n"
+		"ETag: W/\"bc2e-1a8f3c4d5e6f\"\r\n"
+		"Last-Modified: Mon, 12 Oct 2026 08:55:10 GMT\r\n"
+		"Server: cloudflare\r\n"
+		"CF-RAY: 8d2f1e3a4b5c6d7e-SYD\r\n"
+		"Alt-Svc: h3=\":443\"; ma=86400\r\n"
+		"\r\n" },
+};
+
+/* Headers with NUL bytes where the name and a token are matched, lengths given as strlen stops at the first */
+static const char nul_name[] = "HTTP/1.1 200 OK\r\nconnection\0\0\0\0: x\r\n\r\n";
+static const char nul_token[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\0\0\0\0\r\n\r\n";
+
+/* The previous scanner: the status digit at a fixed offset, then newlines counted a byte at a time */
+struct old_state {
+	int reading2;
+	int position;
+};
+
+static int old_scan(struct old_state* s, const char* respbuff, int rc){
+	int startlen = sizeof("HTTP/1.0 ");
+
+	if (!s->reading2){
+		int i = startlen - s->position;
+
+		if (rc <= i){
+			s->position += rc;
+			return HTTP_MORE;
+		}
+
+		i -= 1;
+		if (respbuff[i] <= '0' || respbuff[i] >= '5'){
+			return HTTP_INVALID;
+		}
+		s->reading2 = 1;
+		s->position = 0;
+		respbuff += i + 2;
+		rc -= i + 2;
+	}
+
+	uint8_t nls = s->position;
+	for (int i = 0; i < rc; i++){
+		if (respbuff[i] == '\n'){
+			if (++nls == 2){
+				return HTTP_OK;
+			}
+		}
+		else if (respbuff[i] != '\r'){
+			nls = 0;
+		}
+	}
+	s->position = nls;
+
+	return HTTP_MORE;
+}
+
+static double elapsed(const struct timespec& start){
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// parse split at every point and compare with the whole response, false on a mismatch
+static bool check_splits(const char* resp, size_t len){
+	struct hck_resp whole, split;
+
+	memset(&whole, 0, sizeof(whole));
+	if (resp_parse(&whole, resp, len) != HTTP_OK){
+		return false;
+	}
+
+	for (size_t step = 1; step < len; step++){
+		int rc = HTTP_MORE;
+
+		memset(&split, 0, sizeof(split));
+		for (size_t off = 0; off < len && rc == HTTP_MORE; off += step){
+			rc = resp_parse(&split, resp + off, min(step, len - off));
+		}
+		if (rc != HTTP_OK || split.status != whole.status || split.length != whole.length ||
+			split.close != whole.close || split.keepalive != whole.keepalive || split.http11 != whole.http11){
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv){
+	long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+	struct timespec start;
+	long sum;
+
+	printf("%ld iterations per response\n", iterations);
+#if defined(__AVX2__)
+	printf("newline search: AVX2\n");
+#elif defined(__SSE2__)
+	printf("newline search: SSE2\n");
+#else
+	printf("newline search: memchr\n");
+#endif
+
+	printf("NUL in a header name: splits %s, in a token: splits %s\n",
+		check_splits(nul_name, sizeof(nul_name) - 1) ? "ok" : "MISMATCH", check_splits(nul_token, sizeof(nul_token) - 1) ? "ok" : "MISMATCH");
+
+	for (size_t r = 0; r < sizeof(responses) / sizeof(responses[0]); r++){
+		const char* resp = responses[r][1];
+		size_t len = strlen(resp);
+		struct hck_resp parsed;
+
+		memset(&parsed, 0, sizeof(parsed));
+		resp_parse(&parsed, resp, len);
+		printf("%-6s %5zu bytes: status %d, length %u, reusable %d, splits %s\n", responses[r][0], len,
+			parsed.status, parsed.length, resp_reusable(&parsed), check_splits(resp, len) ? "ok" : "MISMATCH");
+
+		sum = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (long i = 0; i < iterations; i++){
+			struct old_state s = { 0, 0 };
+			sum += old_scan(&s, resp, len);
+			asm volatile("" : : "r"(resp) : "memory");
+		}
+		double old_secs = elapsed(start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (long i = 0; i < iterations; i++){
+			struct hck_resp p;
+			memset(&p, 0, sizeof(p));
+			sum += resp_parse(&p, resp, len) + p.status;
+			asm volatile("" : : "r"(resp) : "memory");
+		}
+		double new_secs = elapsed(start);
+
+		printf("       byte loop %7.1f ns %6.2f GB/s, resp_parse %7.1f ns %6.2f GB/s (checksum %ld)\n",
+			old_secs * 1e9 / iterations, len * iterations / old_secs / 1e9,
+			new_secs * 1e9 / iterations, len * iterations / new_secs / 1e9, sum);
+	}
+
+	return 0;
+}
@@ -0,0 +1,94 @@
+/*
+Connection table benchmark: memory per connection and lookups per second for
+the old std::map<int, hck_details*> + new/delete scheme against the slab backed
+fd table, at a configurable number of open connections (default 100000).
+
+The kernel hands out the lowest free descriptor, so connections are modelled
+as a dense range of fds looked up in random order.
+*/
+#include "../zabbix_http_check_keepalive.cpp"
+
+#include <malloc.h>
+#include <algorithm>
+
+static size_t heap_used(){
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+}
+
+static double elapsed(const struct timespec& start){
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void report(const char* name, size_t bytes, int conns, long lookups, double secs, long sum){
+	printf("%-10s %8.1f bytes/conn %12.0f lookups/s (checksum %ld)\n",
+		name, (double)bytes / conns, lookups / secs, sum);
+}
+
+int main(int argc, char** argv){
+	int conns = argc > 1 ? atoi(argv[1]) : 100000;
+	long lookups = argc > 2 ? atol(argv[2]) : 20000000;
+	int base = 16;	// listener, clients, stdio...
+	vector<int> order;
+	struct timespec start;
+	size_t before;
+	long sum;
+
+	for (int i = 0; i < conns; i++){
+		order.push_back(base + i);
+	}
+	srand(1);
+	random_shuffle(order.begin(), order.end());
+
+	printf("%d connections, %ld lookups\n", conns, lookups);
+
+	/* the previous scheme */
+	{
+		map<int, struct hck_details*> sockets;
+
+		before = heap_used();
+		for (int i = 0; i < conns; i++){
+			struct hck_details* h = new struct hck_details;
+			h->remote_socket = base + i;
+			sockets[base + i] = h;
+		}
+		size_t bytes = heap_used() - before;
+
+		sum = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (long i = 0; i < lookups; i++){
+			sum += sockets.find(order[i % conns])->second->remote_socket;
+		}
+		report("std::map", bytes, conns, lookups, elapsed(start), sum);
+
+		for (map<int, struct hck_details*>::iterator it = sockets.begin(); it != sockets.end(); it++){
+			delete it->second;
+		}
+	}
+
+	/* slab + fd table */
+	{
+		hck_handle* hck = new hck_handle;
+
+		before = heap_used();
+		for (int i = 0; i < conns; i++){
+			struct hck_details* h = hck->slab.alloc();
+			h->remote_socket = base + i;
+			hck->sockets.insert(base + i, h);
+		}
+		size_t bytes = heap_used() - before;
+
+		sum = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (long i = 0; i < lookups; i++){
+			sum += hck->sockets.find(order[i % conns])->remote_socket;
+		}
+		report("fdtable", bytes, conns, lookups, elapsed(start), sum);
+
+		delete hck;
+	}
+
+	return 0;
+}
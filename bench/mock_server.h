@@ -0,0 +1,250 @@
+/*
+A keepalive HTTP server for the benchmarks, on its own thread. Every request
+(anything up to a blank line) is answered with an empty 200, pipelined
+requests included. It listens on all addresses, so each 127.0.0.x is a
+separate target for the engine.
+
+Set before start(), the server can also hold each response back for a delay,
+close connections after a number of responses, and answer a share of the
+requests with a 503 or by resetting the connection.
+*/
+#ifndef HCK_MOCK_SERVER_H
+#define HCK_MOCK_SERVER_H
+
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <deque>
+#include <vector>
+
+class mock_server {
+public:
+	mock_server() : fd(-1), epfd(-1), port(0), delay(0), max_requests(0), error_rate(0), reset_rate(0),
+		responses(0), stopping(false), seed(1) {}
+
+	// listen on an ephemeral port and start serving, false on failure
+	bool start(){
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		struct epoll_event e;
+		int one = 1;
+
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 4096) == -1){
+			perror("mock_server");
+			return false;
+		}
+		getsockname(fd, (struct sockaddr*)&addr, &len);
+		port = ntohs(addr.sin_port);
+
+		epfd = epoll_create(1024);
+		e.events = EPOLLIN;
+		e.data.fd = fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e);
+
+		return pthread_create(&thread, NULL, run, this) == 0;
+	}
+
+	void stop(){
+		stopping = true;
+		pthread_join(thread, NULL);
+		for (size_t i = 0; i < conns.size(); i++){
+			if (conns[i].matched != -1){
+				close(i);
+			}
+		}
+		close(epfd);
+		close(fd);
+	}
+
+	int fd;
+	int epfd;
+	int port;
+
+	int delay;	// ms each response is held back
+	int max_requests;	// responses per connection, the last says "Connection: close". 0 for no limit
+	int error_rate;	// percent of requests answered with a 503
+	int reset_rate;	// percent of requests answered by resetting the connection
+	volatile uint64_t responses;	// sent, resets included
+
+private:
+	enum action { ANSWERED, CLOSING, RESET };
+
+	struct conn {
+		int matched;	// progress through "\r\n\r\n", -1 if closed
+		int answered;
+		uint32_t generation;	// bumped when the descriptor is reused
+		bool closing;	// the last response is sent, waiting for the client to close
+	};
+
+	// a request held back until due
+	struct delayed {
+		uint64_t due;
+		int fd;
+		uint32_t generation;
+	};
+
+	static void* run(void* arg){
+		((mock_server*)arg)->loop();
+		return NULL;
+	}
+
+	static uint64_t now_ms(){
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	}
+
+	void drop(int c, bool reset){
+		if (reset){
+			struct linger l = { 1, 0 };
+			setsockopt(c, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+		}
+		conns[c].matched = -1;
+		close(c);
+	}
+
+	// append the response to the next request on c to out, the connection is closed or reset after out is sent
+	int respond(int c, char* out, size_t* len, size_t size){
+		struct conn& s = conns[c];
+		int roll = rand_r(&seed) % 100;
+		bool last;
+
+		responses++;
+		if (roll < reset_rate){
+			return RESET;
+		}
+
+		s.answered++;
+		last = max_requests > 0 && s.answered >= max_requests;
+		*len += snprintf(out + *len, size - *len, "HTTP/1.1 %s\r\nContent-Length: 0\r\n%s\r\n",
+			roll < reset_rate + error_rate ? "503 Service Unavailable" : "200 OK", last ? "Connection: close\r\n" : "");
+		return last ? CLOSING : ANSWERED;
+	}
+
+	// send out, then close or reset c if the last response asked for it
+	void flush(int c, const char* out, size_t len, int action){
+		if (len > 0){
+			send(c, out, len, MSG_NOSIGNAL);
+		}
+		if (action == RESET){
+			drop(c, true);
+		}
+		else if (action == CLOSING){
+			/* Read on until the client closes, so requests already sent do not turn the close into a reset */
+			conns[c].closing = true;
+			shutdown(c, SHUT_WR);
+		}
+	}
+
+	// answer the held back requests that are due, the time until the next one is
+	int release(){
+		char out[256];
+		uint64_t now = now_ms();
+
+		while (!pending.empty() && pending.front().due <= now){
+			struct delayed d = pending.front();
+			size_t len = 0;
+
+			pending.pop_front();
+			if (conns[d.fd].matched == -1 || conns[d.fd].generation != d.generation || conns[d.fd].closing){
+				continue;
+			}
+			int action = respond(d.fd, out, &len, sizeof(out));
+			flush(d.fd, out, len, action);
+		}
+
+		return pending.empty() ? 100 : (int)(pending.front().due - now);
+	}
+
+	void loop(){
+		struct epoll_event events[64];
+		char buf[4096];
+		char out[8192];
+		int timeout = 100;
+
+		while (!stopping){
+			int n = epoll_wait(epfd, events, 64, timeout);
+			for (int i = 0; i < n; i++){
+				int c = events[i].data.fd;
+
+				if (c == fd){
+					while ((c = accept4(fd, NULL, NULL, SOCK_NONBLOCK)) != -1){
+						struct epoll_event e;
+						e.events = EPOLLIN;
+						e.data.fd = c;
+						epoll_ctl(epfd, EPOLL_CTL_ADD, c, &e);
+						if ((size_t)c >= conns.size()){
+							struct conn unused = { -1, 0, 0, false };
+							conns.resize(c + 1, unused);
+						}
+						conns[c].matched = 0;
+						conns[c].answered = 0;
+						conns[c].generation++;
+						conns[c].closing = false;
+					}
+					continue;
+				}
+
+				int rc = recv(c, buf, sizeof(buf), 0);
+				if (rc <= 0){
+					if (rc == -1 && errno == EAGAIN){
+						continue;
+					}
+					drop(c, false);
+					continue;
+				}
+				if (conns[c].closing){
+					continue;
+				}
+
+				/* Count request ends, "\r\n\r\n", across reads */
+				size_t len = 0;
+				int action = ANSWERED;
+				for (int j = 0; j < rc && action == ANSWERED; j++){
+					char ch = buf[j];
+					int m = conns[c].matched;
+					if ((ch == '\r' && (m == 0 || m == 2)) || (ch == '\n' && (m == 1 || m == 3))){
+						m++;
+					}
+					else{
+						m = ch == '\r' ? 1 : 0;
+					}
+					if (m == 4){
+						if (delay > 0){
+							struct delayed d = { now_ms() + delay, c, conns[c].generation };
+							pending.push_back(d);
+						}
+						else if (len + 128 <= sizeof(out)){
+							action = respond(c, out, &len, sizeof(out));
+						}
+						m = 0;
+					}
+					conns[c].matched = m;
+				}
+				flush(c, out, len, action);
+			}
+
+			timeout = delay > 0 ? release() : 100;
+		}
+	}
+
+	volatile bool stopping;
+	pthread_t thread;
+	unsigned int seed;
+	std::vector<struct conn> conns;	// by descriptor
+	std::deque<struct delayed> pending;	// held back requests, oldest first
+};
+
+#endif
@@ -0,0 +1,97 @@
+/*
+Runs the check workers on their own, outside of zabbix, so that every agent and
+proxy on the host sends its checks to the same workers and shares their
+keepalive pools. Set Daemon=1 for the module to connect to these workers
+instead of forking its own; the daemon and the module read the same
+configuration, which gives the Socket name and the number of Workers.
+
+A worker that exits is started again. SIGTERM, SIGINT or SIGHUP stop them all.
+
+	hck_daemon [-c config] [-v]
+*/
+#include "zabbix_http_check_keepalive.cpp"
+
+#include <sys/wait.h>
+
+static volatile sig_atomic_t stop = 0;
+
+static void handle_stop(int signal){
+	stop = 1;
+}
+
+static pid_t start_worker(int worker){
+	pid_t pid = fork();
+
+	if (pid == 0){
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		processing_thread(worker);
+	}
+	if (pid == -1){
+		zabbix_log(LOG_LEVEL_ERR, "HCK: unable to start worker #%d: %s", worker + 1, strerror(errno));
+	}
+	return pid;
+}
+
+int main(int argc, char** argv){
+	const char* path = getenv("HCK_CONFIG") != NULL ? getenv("HCK_CONFIG") : config_path;
+	pid_t pids[HCK_MAX_WORKERS];
+	struct sigaction sa;
+	int opt, status;
+
+	while ((opt = getopt(argc, argv, "c:v")) != -1){
+		switch (opt){
+		case 'c': path = optarg; break;
+		case 'v': hck_log_level++; break;
+		default:
+			fprintf(stderr, "usage: %s [-c config] [-v]\n", argv[0]);
+			return 1;
+		}
+	}
+	load_config(path);
+
+	/* No SA_RESTART, a signal ends the wait for the workers */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &handle_stop;
+	sigfillset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	for (int i = 0; i < config.workers; i++){
+		pids[i] = start_worker(i);
+	}
+	zabbix_log(LOG_LEVEL_ERR, "HCK: daemon started with %d workers on socket %s", config.workers, config.socket_name);
+
+	while (!stop){
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid == -1){
+			if (errno == EINTR){
+				continue;
+			}
+			break;
+		}
+
+		for (int i = 0; i < config.workers; i++){
+			if (pids[i] == pid){
+				zabbix_log(LOG_LEVEL_ERR, "HCK: worker #%d exited (status %d), starting it again", i + 1, status);
+				sleep(1);
+				pids[i] = stop ? -1 : start_worker(i);
+			}
+		}
+	}
+
+	for (int i = 0; i < config.workers; i++){
+		if (pids[i] > 0){
+			kill(pids[i], SIGHUP);
+		}
+	}
+	for (int i = 0; i < config.workers; i++){
+		if (pids[i] > 0){
+			waitpid(pids[i], NULL, 0);
+		}
+	}
+	zabbix_log(LOG_LEVEL_ERR, "HCK: daemon stopped");
+
+	return 0;
+}
@@ -0,0 +1,49 @@
+/*
+Stand-ins for the parts of the zabbix agent API used by the engine, so that it
+can be built outside of zabbix (benchmarks and tools) with -DHCK_STANDALONE.
+*/
+#ifndef HCK_STANDALONE_H
+#define HCK_STANDALONE_H
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOG_LEVEL_CRIT 1
+#define LOG_LEVEL_ERR 2
+#define LOG_LEVEL_WARNING 3
+#define LOG_LEVEL_DEBUG 4
+
+// messages at or below this level are written to stderr
+static int hck_log_level = LOG_LEVEL_ERR;
+
+static void zabbix_log(int level, const char* fmt, ...){
+	va_list args;
+
+	if (level > hck_log_level){
+		return;
+	}
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+static inline size_t zbx_strlcpy(char* dst, const char* src, size_t siz){
+	size_t len = strlen(src);
+
+	if (siz != 0){
+		size_t n = len < siz - 1 ? len : siz - 1;
+		memcpy(dst, src, n);
+		dst[n] = 0;
+	}
+	return len;
+}
+
+static inline void zbx_setproctitle(const char* fmt, ...){
+}
+
+#endif
@@ -4,20 +4,49 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <map>
+#include <unordered_map>
+#include <deque>
+#include <string>
 #include <errno.h>
 #include <time.h>
 #include <vector>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <sys/prctl.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <netdb.h>
+#include <sched.h>
+#include <ctype.h>
 #include <functional>
-#include <functional>
+#include <algorithm>
 #include <cstring>
+#include <poll.h>
+#include <netinet/tcp.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if !defined(HCK_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+/* the ring needs the timeout argument to io_uring_enter (linux 5.11) */
+#if defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup)
+#define HCK_IO_URING
+#endif
+#endif
+#endif
+#ifdef HCK_STANDALONE
+#include "hck_standalone.h"
+#else
 #include "sysinc.h"
 #include "module.h"
 
@@ -25,6 +54,9 @@ extern "C" {
 	#include "common.h"
 	#include "log.h"
 	int    zbx_module_hck_check(AGENT_REQUEST *request, AGENT_RESULT *result);
+	int    zbx_module_hck_latency(AGENT_REQUEST *request, AGENT_RESULT *result);
+	int    zbx_module_hck_stats(AGENT_REQUEST *request, AGENT_RESULT *result);
+	int    zbx_module_hck_check_bulk(AGENT_REQUEST *request, AGENT_RESULT *result);
 }
 
 
@@ -32,796 +64,5007 @@ static ZBX_METRIC keys[] =
 /* KEY               FLAG           FUNCTION                TEST PARAMETERS */
 {
 	{ "hck.check", CF_HAVEPARAMS, (int(*)())zbx_module_hck_check, "203.13.161.80,80" },
+	{ "hck.latency", CF_HAVEPARAMS, (int(*)())zbx_module_hck_latency, "203.13.161.80,80,header" },
+	{ "hck.stats", CF_HAVEPARAMS, (int(*)())zbx_module_hck_stats, "checks" },
+	{ "hck.check.bulk", CF_HAVEPARAMS, (int(*)())zbx_module_hck_check_bulk, "203.13.161.80:80,203.13.161.81:80" },
 	{ NULL }
 };
+#endif
 
-const char http_request[] = "HEAD / HTTP/1.0\r\nConnection:Keep-Alive\r\n\r\n";
-#define http_request_size (sizeof(http_request) - 1)
-int http_resp_startlen = sizeof("HTTP/1.0 ");//or "HTTP 1.1" same length
-
-#define READSIZE 1024
-#define MAXEVENTS 16
-#define TIMEOUT_RECOVER 3
-#define TIMEOUT_NEW 4
-#define TIMEOUT_POST 60
-
-const char *socket_path = "\0hck";
-volatile int running = 1;
-
-using namespace std;
-
-struct cmp_map {
-	bool operator()(
-		const struct sockaddr& lhs,
-		const struct sockaddr& rhs) const
-	{
-		return std::memcmp(&lhs, &rhs, sizeof(struct sockaddr)) < 0;
-	}
-};
-
-// a check
-struct hck_details {
-	time_t expires;
-	int client_socket;
-	int remote_socket;
-	struct sockaddr remote_connection;
-	unsigned int remote_connection_len : 8;
-	unsigned short position : 16;
-	enum {
-		connecting = 1,
-		writing = 2,
-		reading1 = 3,
-		reading2 = 4,
-		keepalive = 5,
-		recovery = 6
-	} state: 6;
-	bool first : 1;
-	bool tfo : 1;
+/* check request defaults, the Host header defaults to the host checked */
+#define HCK_DEFAULT_METHOD "HEAD"
+#define HCK_DEFAULT_PATH "/"
+
+/* http_parse results */
+#define HTTP_MORE 0
+#define HTTP_OK 1
+#define HTTP_INVALID 2
+
+/* response parser states */
+enum {
+	RESP_VERSION = 0,	// "HTTP/1.x "
+	RESP_STATUS,	// the three digits of the status code
+	RESP_REASON,	// rest of the status line
+	RESP_LINE,	// start of a header line, or the blank line ending the headers
+	RESP_NAME,	// header name, matched against the headers we use
+	RESP_VALUE,	// value of a header we use
+	RESP_SKIP,	// rest of a line we do not use
+	RESP_DONE
 };
 
-// the hck system (could be exported outside of zabbix in future)
-class hck_handle {
-public:
-	int epfd;
-	map<int, struct hck_details*> sockets;
-	map<struct sockaddr, int, struct cmp_map> keepalived;
+/* headers we use, also the candidate bits while a name is matched */
+#define RESP_CONNECTION 1
+#define RESP_CONTENT_LENGTH 2
+static const char* const resp_headers[] = { NULL, "connection", "content-length" };
+static const uint8_t resp_headers_len[] = { 0, 10, 14 };
+/* Connection tokens */
+#define RESP_CLOSE 1
+#define RESP_KEEPALIVE 2
+static const char* const resp_tokens[] = { NULL, "close", "keep-alive" };
+static const uint8_t resp_tokens_len[] = { 0, 5, 10 };
+
+// incremental parser for the status line and headers, a response can be split across any number of reads
+struct hck_resp {
+	uint16_t status;
+	uint8_t state;
+	uint8_t match;	// characters matched of a header name or Connection token
+	uint32_t length;	// Content-Length, if has_length
+	uint8_t header : 2;	// candidate headers while matching a name, then the header being read
+	uint8_t tokens : 2;	// candidate Connection tokens
+	bool http11 : 1;
+	bool close : 1;	// Connection: close
+	bool keepalive : 1;	// Connection: keep-alive
+	bool has_length : 1;
+	bool value : 1;	// past the spaces before a value
 };
 
-//send result from worker -> process
-bool send_result(hck_handle* hck, int sock, unsigned short result){
-	//Communication socket failed!
-	if (sock == -1) {
-		return true;
+// first '\n' in [p, end), or end
+static const char* resp_newline(const char* p, const char* end){
+#if defined(__SSE2__)
+#if defined(__AVX2__)
+	const __m256i nl32 = _mm256_set1_epi8('\n');
+	for (; end - p >= 32; p += 32){
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), nl32));
+		if (mask != 0){
+			return p + __builtin_ctz(mask);
+		}
 	}
-
-	// Actually send result
-	int rc = send(sock, &result, sizeof(result), 0);
-	return rc >= 0;
+#endif
+	const __m128i nl = _mm_set1_epi8('\n');
+	for (; end - p >= 16; p += 16){
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), nl));
+		if (mask != 0){
+			return p + __builtin_ctz(mask);
+		}
+	}
+	for (; p < end; p++){
+		if (*p == '\n'){
+			return p;
+		}
+	}
+	return end;
+#else
+	p = (const char*)memchr(p, '\n', end - p);
+	return p != NULL ? p : end;
+#endif
 }
 
-static hck_details* keepalive_lookup(hck_handle* hck, unsigned int sockaddr_len,  struct sockaddr sockaddr, time_t now, int source) {
-	map<struct sockaddr, int>::iterator it;
-	struct epoll_event e;
-	int rc;
-
-	it = hck->keepalived.find(sockaddr);
-	if (it != hck->keepalived.end()) {
-		struct hck_details* h = hck->sockets[it->second];
-
-		assert(h->remote_connection_len == sockaddr_len);
-		assert(memcmp(&h->remote_connection, &sockaddr, sockaddr_len) == 0);
-		assert(h->state == hck_details::keepalive);
-
-		//Remove from keepalive
-		int erased = hck->keepalived.erase(it->first);
-		assert(erased == 1);
+// narrow a set of candidate strings (bits of index) to those with c at position match, none past its end
+static uint8_t resp_candidates(uint8_t candidates, const char* const* strings, const uint8_t* lens, uint8_t match, char c){
+	if (c >= 'A' && c <= 'Z'){
+		c += 'a' - 'A';
+	}
+	for (int i = 1; i <= 2; i++){
+		if ((candidates & i) && (match >= lens[i] || strings[i][match] != c)){
+			candidates &= ~i;
+		}
+	}
+	return candidates;
+}
 
-		h->state = hck_details::recovery;
-		h->position = 0;
-		h->expires = now + TIMEOUT_RECOVER;
-		h->client_socket = source;
-		h->first = false;
-		h->tfo = true;
+static void resp_value_start(struct hck_resp* r, uint8_t header){
+	r->state = RESP_VALUE;
+	r->header = header;
+	r->tokens = RESP_CLOSE | RESP_KEEPALIVE;
+	r->match = 0;
+	r->value = false;
+}
 
-		e.events = EPOLLOUT;
-		e.data.fd = h->remote_socket;
-		rc = epoll_ctl(hck->epfd, EPOLL_CTL_MOD, h->remote_socket, &e);
-		if (rc < 0)
-		{
-			zabbix_log(LOG_LEVEL_WARNING, "Unable to mod socket epoll for recovery: %s", strerror(errno));
-			return NULL;
+// case insensitive prefix match against a lower case name, p must hold len bytes
+static bool resp_name_is(const char* p, const char* name, size_t len){
+	for (size_t i = 0; i < len; i++){
+		if ((p[i] | 0x20) != name[i]){
+			return false;
 		}
-
-		return h;
 	}
-
-	return NULL;
+	return true;
 }
 
-static int create_new_socket(unsigned int sockaddr_len, struct sockaddr sockaddr, bool fastopen = true) {
-	int socket_desc;
-	int rc;
+/*
+Read the value of a header we use when the rest of its line is on hand, then
+continue from the end of the line. Returns NULL to read it byte by byte.
+*/
+static const char* resp_value(struct hck_resp* r, const char* p, const char* end){
+	const char* eol = resp_newline(p, end);
+	size_t len;
 
-	//Create socket
-	socket_desc = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-	if (socket_desc == -1)
-	{
-		return -1;
+	if (eol == end){
+		return NULL;
 	}
 
-	//Connect to remote server
-#ifdef MSG_FASTOPEN
-	if (fastopen)
-	{
-		rc = sendto(socket_desc, http_request, http_request_size, MSG_FASTOPEN, &sockaddr, sockaddr_len);
-	}
-	else
-	{
-		rc = connect(socket_desc, &sockaddr, sockaddr_len);
-	}
-#else
-	rc = connect(socket_desc, &sockaddr, sockaddr_len);
-#endif
-	if (rc != -1){
-		return socket_desc;
+	while (p < eol && (*p == ' ' || *p == '\t')){
+		p++;
 	}
-	else
-	{
-		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
-			return socket_desc;
-		}
-		return rc;
+	for (len = 0; p + len < eol && p[len] != '\r' && p[len] != ',' && p[len] != ' ' && p[len] != '\t' && p[len] != ';'; len++){
 	}
-}
 
-static struct hck_details* create_new_hck(hck_handle* hck, unsigned int sockaddr_len, struct sockaddr sockaddr, time_t now, int source, bool fastopen = true) {
-	int rc, socket_desc;
-	struct epoll_event e;
-	struct hck_details* h = NULL;
-	
-	socket_desc = create_new_socket(sockaddr_len, sockaddr, fastopen);
-	if (socket_desc == -1)
-	{
-		zabbix_log(LOG_LEVEL_WARNING, "Unable to create new socket: %s", strerror(errno));
-		goto error;
-	}
+	if (r->header == RESP_CONTENT_LENGTH){
+		uint32_t length = 0;
 
-	h = new struct hck_details;
-	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) 
-	{
-#ifdef MSG_FASTOPEN
-		e.events = EPOLLOUT;
-		h->state = hck_details::writing;
-		h->position = 0;
-#else
-		e.events = EPOLLIN | EPOLLOUT;
-		h->state = hck_details::connecting;
-#endif
-	}else{
-#ifdef MSG_FASTOPEN
-		if (rc < http_request_size) 
-		{
-			e.events = EPOLLOUT;
-			h->state = hck_details::writing;
-			h->position = rc;
-		}
-		else 
-		{
-			e.events = EPOLLIN;
-			h->state = hck_details::reading1;
-			h->position = 0;
+		for (size_t i = 0; i < len; i++){
+			if (p[i] < '0' || p[i] > '9' || length > (UINT32_MAX - 9) / 10){
+				/* The framing cannot be trusted, do not reuse the connection */
+				r->close = true;
+				len = 0;
+				break;
+			}
+			length = length * 10 + (p[i] - '0');
 		}
-#else
-		e.events = EPOLLOUT;
-		h->state = hck_details::writing;
-		h->position = 0;
-#endif
+		r->length = length;
+		r->has_length = len > 0;
 	}
-	e.data.fd = socket_desc;
-	rc = epoll_ctl(hck->epfd, EPOLL_CTL_ADD, socket_desc, &e);
-	if (rc < 0)
-	{
-		zabbix_log(LOG_LEVEL_WARNING, "Unable to add socket to epoll: %s", strerror(errno));
-		goto error;
+	else if (len == resp_tokens_len[RESP_CLOSE] && resp_name_is(p, resp_tokens[RESP_CLOSE], len)){
+		r->close = true;
+	}
+	else if (len == resp_tokens_len[RESP_KEEPALIVE] && resp_name_is(p, resp_tokens[RESP_KEEPALIVE], len)){
+		r->keepalive = true;
 	}
 
-	h->expires = now + TIMEOUT_NEW;
-	h->client_socket = source;
-	h->remote_connection = sockaddr;
-	h->remote_connection_len = sockaddr_len;
-	h->remote_socket = socket_desc;
-	h->first = true;
-	h->tfo = true;
+	r->state = RESP_LINE;
+	return eol + 1;
+}
 
-	return h;
-error:
-	close(socket_desc);
-	if (h != NULL){
-		delete h;
+static void resp_value_end(struct hck_resp* r){
+	if (r->header == RESP_CONNECTION){
+		if ((r->tokens & RESP_CLOSE) && r->match == resp_tokens_len[RESP_CLOSE]){
+			r->close = true;
+		}
+		else if ((r->tokens & RESP_KEEPALIVE) && r->match == resp_tokens_len[RESP_KEEPALIVE]){
+			r->keepalive = true;
+		}
 	}
-	return NULL;
 }
 
-// add a check in the worker
-bool check_add(hck_handle* hck, struct addrinfo addr, struct sockaddr sockaddr, time_t now, int source, bool tfo = true){
-	struct hck_details* h;
-
-	h = keepalive_lookup(hck, addr.ai_addrlen, sockaddr, now, source);
-
-	if (h == NULL) {
-		h = create_new_hck(hck, addr.ai_addrlen, sockaddr, now, source, tfo);
+/*
+Feed response bytes to the parser. Whole header lines we do not use are
+skipped with a vectorized newline search, only the status line, the start of
+each header line and the values of the headers we use are looked at byte by
+byte. Returns HTTP_OK at the blank line ending the headers, with the bytes
+taken up to there in used.
+*/
+static int resp_parse(struct hck_resp* r, const char* p, size_t len, size_t* used = NULL){
+	const char* start = p;
+	const char* end = p + len;
+	char c;
+
+	while (p < end){
+		switch (r->state){
+		case RESP_VERSION:
+			/* The whole status line start is usually in the first read */
+			if (r->match == 0 && end - p >= 13 && memcmp(p, "HTTP/1.", 7) == 0 && p[7] >= '0' && p[7] <= '9' && p[8] == ' ' &&
+				p[9] >= '1' && p[9] <= '9' && p[10] >= '0' && p[10] <= '9' && p[11] >= '0' && p[11] <= '9' &&
+				(p[12] == ' ' || p[12] == '\r' || p[12] == '\n')){
+				r->http11 = p[7] != '0';
+				r->status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+				r->state = p[12] == '\n' ? RESP_LINE : RESP_REASON;
+				p += 13;
+				break;
+			}
+			c = *p++;
+			if (r->match < 7){
+				if (c != "HTTP/1."[r->match]){
+					return HTTP_INVALID;
+				}
+				r->match++;
+			}
+			else if (r->match == 7 && c >= '0' && c <= '9'){
+				r->http11 = c != '0';
+				r->match++;
+			}
+			else if (r->match == 8 && c == ' '){
+				r->state = RESP_STATUS;
+				r->match = 0;
+			}
+			else{
+				return HTTP_INVALID;
+			}
+			break;
+		case RESP_STATUS:
+			c = *p++;
+			if (r->match < 3 && c >= '0' && c <= '9'){
+				r->status = r->status * 10 + (c - '0');
+				r->match++;
+			}
+			else if (r->match == 3 && r->status >= 100 && (c == ' ' || c == '\r' || c == '\n')){
+				r->state = c == '\n' ? RESP_LINE : RESP_REASON;
+			}
+			else{
+				return HTTP_INVALID;
+			}
+			break;
+		case RESP_REASON:
+		case RESP_SKIP:
+			/* Go from line to line while the lines are not ones we use */
+			for (;;){
+				p = resp_newline(p, end);
+				if (p == end){
+					break;
+				}
+				p++;
+				if (p < end && *p == '\r' && p + 1 < end && p[1] == '\n'){
+					r->state = RESP_DONE;
+					if (used != NULL){
+						*used = p + 2 - start;
+					}
+					return HTTP_OK;
+				}
+				if (p == end || (*p | 0x20) == 'c' || *p == '\r' || *p == '\n'){
+					r->state = RESP_LINE;
+					break;
+				}
+				r->state = RESP_SKIP;
+			}
+			break;
+		case RESP_LINE:
+			c = *p;
+			if (c == '\n'){
+				r->state = RESP_DONE;
+				if (used != NULL){
+					*used = p + 1 - start;
+				}
+				return HTTP_OK;
+			}
+			if (c == '\r'){
+				p++;
+				break;
+			}
+			/* Most header names are ruled out by the first character */
+			if ((c | 0x20) != 'c'){
+				r->state = RESP_SKIP;
+				break;
+			}
+			if (end - p > resp_headers_len[RESP_CONTENT_LENGTH]){
+				if (resp_name_is(p, "connection:", resp_headers_len[RESP_CONNECTION] + 1)){
+					p += resp_headers_len[RESP_CONNECTION] + 1;
+					resp_value_start(r, RESP_CONNECTION);
+				}
+				else if (resp_name_is(p, "content-length:", resp_headers_len[RESP_CONTENT_LENGTH] + 1)){
+					p += resp_headers_len[RESP_CONTENT_LENGTH] + 1;
+					resp_value_start(r, RESP_CONTENT_LENGTH);
+				}
+				else{
+					r->state = RESP_SKIP;
+					break;
+				}
 
-		if (h != NULL) {
-			//Assert that socket entries are cleaned up when sockets are closed
-			assert(hck->sockets.find(h->remote_socket) == hck->sockets.end());
-			assert(h->client_socket == source);
-			hck->sockets[h->remote_socket] = h;
-			return true;
+				const char* next = resp_value(r, p, end);
+				if (next != NULL){
+					p = next;
+				}
+				break;
+			}
+			/* The name may continue in the next read */
+			r->state = RESP_NAME;
+			r->header = RESP_CONNECTION | RESP_CONTENT_LENGTH;
+			r->match = 0;
+			break;
+		case RESP_NAME:
+			c = *p++;
+			if (c == ':'){
+				if ((r->header & RESP_CONNECTION) && r->match == resp_headers_len[RESP_CONNECTION]){
+					resp_value_start(r, RESP_CONNECTION);
+				}
+				else if ((r->header & RESP_CONTENT_LENGTH) && r->match == resp_headers_len[RESP_CONTENT_LENGTH]){
+					resp_value_start(r, RESP_CONTENT_LENGTH);
+				}
+				else{
+					r->state = RESP_SKIP;
+				}
+				break;
+			}
+			if (c == '\n'){
+				r->state = RESP_LINE;
+				break;
+			}
+			r->header = resp_candidates(r->header, resp_headers, resp_headers_len, r->match, c);
+			r->match++;
+			if (r->header == 0){
+				r->state = RESP_SKIP;
+			}
+			break;
+		case RESP_VALUE:
+			c = *p++;
+			if (!r->value){
+				if (c == ' ' || c == '\t'){
+					break;
+				}
+				r->value = true;
+			}
+			if (c == '\r' || c == '\n' || c == ',' || c == ' ' || c == '\t' || c == ';'){
+				resp_value_end(r);
+				r->state = c == '\n' ? RESP_LINE : RESP_SKIP;
+				break;
+			}
+			if (r->header == RESP_CONTENT_LENGTH){
+				if (c < '0' || c > '9' || r->length > (UINT32_MAX - 9) / 10){
+					r->close = true;
+					r->has_length = false;
+					r->state = RESP_SKIP;
+					break;
+				}
+				r->length = r->length * 10 + (c - '0');
+				r->has_length = true;
+			}
+			else{
+				r->tokens = resp_candidates(r->tokens, resp_tokens, resp_tokens_len, r->match, c);
+				r->match++;
+				if (r->tokens == 0){
+					r->state = RESP_SKIP;
+				}
+			}
+			break;
+		default:
+			if (used != NULL){
+				*used = 0;
+			}
+			return HTTP_OK;
 		}
 	}
-	else
-	{
-		assert(hck->sockets[h->remote_socket] == h);
-		assert(h->client_socket == source);
-		return true;
-	}
 
-	return false;
+	return HTTP_MORE;
 }
 
-static void http_cleanup(hck_handle& hck, struct hck_details* h){
-	int erased;
+// can the connection take another request after this response
+static bool resp_reusable(const struct hck_resp* r){
+	return r->http11 ? !r->close : r->keepalive;
+}
 
-	if (h->state == hck_details::keepalive){
-		//Assert that the DB is in the correct state
-		assert(hck.keepalived.find(h->remote_connection) != hck.keepalived.end());
+#define READSIZE 1024
+#define MAXEVENTS 16	// initial batch, doubled whenever a wait fills it
+#define MAXEVENTS_LIMIT 4096
+/* default timeouts in milliseconds */
+#define TIMEOUT_RECOVER 3000
+#define TIMEOUT_NEW 4000
+#define TIMEOUT_POST 60000
+/* targets without connections are forgotten after this long (ms) */
+#define TARGET_TTL 600000
+/* targets that did not take TCP Fast Open are tried with it again after this long (ms) */
+#define TFO_RETRY 600000
+#define HCK_MAX_WORKERS 64
+#define SLAB_SIZE 1024
+#define CACHE_LINE 64
+#define URING_ENTRIES 1024
+#define PIPELINE_MAX 8	// requests on a connection, the current one and those queued behind it
+/* scheduled checks, see schedule_learn */
+#define SCHEDULE_MIN 1000	// shorter gaps between requests are bursts, not an interval (ms)
+#define SCHEDULE_IDLE 3	// intervals without a request before a target is no longer checked on its own
+
+#define SOCKET_NAME_MAX 64	// worker sockets are this name and the worker number, in the abstract namespace
+#define STATE_SAVE_INTERVAL 600000	// the known targets are written to the state file at most this often if they changed (ms)
+#define FD_RESERVE 64	// descriptors kept out of the check socket budget, at least, for pollers and the worker itself
+
+const char *config_path = "/etc/zabbix/zabbix_http_check_keepalive.conf";
+volatile int running = 1;
 
-		//Clear the keepalive
-		erased = hck.keepalived.erase(h->remote_connection);
-		assert(erased == 1);
-	}
+using namespace std;
 
-	//Cleanup remote
-	if (h->remote_socket != -1){
-		erased = hck.sockets.erase(h->remote_socket);
-		assert(erased == 1);
-		shutdown(h->remote_socket, SHUT_RDWR);
-		close(h->remote_socket);
-	}
+enum hck_backend {
+	BACKEND_EPOLL = 0,
+	BACKEND_URING = 1	// falls back to epoll if the kernel or the build lacks io_uring
+};
 
+// module configuration, loaded once in the agent before the workers are forked
+struct hck_config {
+	int workers = 1;
+	int worker_cpus[HCK_MAX_WORKERS];
+	int worker_cpus_count = 0;
+	int timeout_new = TIMEOUT_NEW;
+	int timeout_recover = TIMEOUT_RECOVER;
+	int timeout_post = TIMEOUT_POST;
+	bool timeout_adaptive = false;	// derive the check timeouts from each target's round trip times, up to the ones above
+	int timeout_min = 100;	// adaptive timeouts are never shorter (ms)
+	int keepalive_min = 0;
+	int keepalive_max = 8;
+	int dns_threads = 2;
+	int dns_ttl = 60000;
+	int dns_negative_ttl = 5000;
+	int happy_eyeballs_delay = 250;	// between connects to the next address of a host that resolves to several (ms), 0 to use the first only
+	bool coalesce = true;
+	int pipeline = 4;	// without coalescing, requests per keepalive connection
+	int result_cache = 0;
+	bool schedule = false;	// learn the interval targets are checked at and check them ahead of the pollers
+	int backend = BACKEND_EPOLL;
+	bool edge_triggered = true;	// epoll backend, register check sockets once
+	char socket_name[SOCKET_NAME_MAX] = "hck";
+	int listen_backlog = 128;	// pending poller connections per worker
+	bool daemon = false;	// the workers run in hck_daemon, the module only connects to them
+	string state_file;	// the targets of worker n are kept in this file with .n appended, empty to keep none
+	int warm_rate = 100;	// connections per second opened to the saved targets at startup
+	int fd_budget = 0;	// check sockets a worker may have open, 0 to derive it from RLIMIT_NOFILE
+};
 
-	linger lin;
-	unsigned int y = sizeof(lin);
-	lin.l_onoff = 1;
-	lin.l_linger = 10;
-	setsockopt(h->client_socket, SOL_SOCKET, SO_LINGER, (void*)(&lin), y);
+static struct hck_config config;
+
+// syscalls and events of the worker, per process. A worker is one thread, plain increments do
+struct hck_counters {
+	uint64_t epoll_wait;
+	uint64_t epoll_events;	// returned by epoll_wait
+	uint64_t epoll_ctl;
+	uint64_t uring_enter;
+	uint64_t socket;
+	uint64_t connect;
+	uint64_t send;
+	uint64_t recv;
+	uint64_t close;
+	uint64_t checks;	// checks that ran to a result on a remote connection
+	uint64_t completions;	// io_uring completions handled
+	uint64_t waits;	// event loop iterations
+	uint64_t busy_ns;	// time the loop spent handling events rather than waiting
+	uint64_t requests;	// check requests from pollers
+	uint64_t keepalive_hits;	// checks sent on a pooled connection
+	uint64_t keepalive_misses;	// checks that needed a new connection
+	uint64_t keepalive_stale;	// pooled connections found closed when taken
+	uint64_t keepalive_expired;	// idle connections closed after TimeoutPost
+	uint64_t tfo_fallbacks;	// connects retried without TCP Fast Open
+	uint64_t tfo_accepted;	// requests sent in the SYN and taken by the server
+	uint64_t tfo_skipped;	// connects made without TCP Fast Open to targets known not to take it
+	uint64_t bulk;	// checks requested in bulk requests
+	uint64_t evicted;	// idle connections closed to make room for new ones
+	uint64_t overloaded;	// requests turned away and scheduled runs skipped, no socket could be had within the budget
+	uint64_t expired;	// checks that timed out
+	uint64_t retries;	// checks started again on a new connection
+	uint64_t coalesced;	// requests that joined a check in flight
+	uint64_t pipelined;	// requests sent behind another on a connection
+	uint64_t cached;	// requests answered from the result cache
+	uint64_t scheduled;	// checks started by the schedule rather than a request
+	uint64_t warmed;	// connections opened at startup to the saved targets
+	uint64_t raced;	// requests raced across the addresses of a host
+	uint64_t fallbacks;	// races won by an address other than the one tried first
+};
 
-	//Close client socket
-	shutdown(h->client_socket, SHUT_RDWR);
-	close(h->client_socket);
+static struct hck_counters counters;
 
-	//Finally free memory
-	delete h;
+// FNV-1a, used to spread targets across the workers
+static uint32_t hck_hash(const void* data, size_t len, uint32_t h = 2166136261u){
+	const unsigned char* p = (const unsigned char*)data;
+	while (len--){
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	return h;
 }
 
-// handle a http event
-void handle_http(hck_handle& hck, struct epoll_event e, time_t now){
-	int rc;
-	struct hck_details* h;
-	char respbuff[READSIZE];
+// monotonic milliseconds, all deadlines in the worker use this clock
+static uint64_t monotonic_ms(){
+	struct timespec ts;
 
-	h = hck.sockets[e.data.fd];
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	if (h->state == hck_details::connecting){
-		if (e.events & EPOLLIN || e.events & EPOLLOUT){
-			/* Connection success */
-			e.events = EPOLLOUT;
-			rc = epoll_ctl(hck.epfd, EPOLL_CTL_MOD, e.data.fd, &e);
-			if (rc < 0)
-			{
-				zabbix_log(LOG_LEVEL_WARNING, "Unable to mod epoll: %s", strerror(errno));
-			}
-			h->state = hck_details::writing;
-		}
-		else{
-			/* Failed to connect */
-			if (h->tfo){
-				/* Attempt to re-connect without TFO */
-				h->tfo = false;
-
-				int erased = hck.sockets.erase(e.data.fd);
-				assert(erased == 1);
-
-				close(h->remote_socket);
-				h->remote_socket = create_new_socket(h->remote_connection_len, h->remote_connection, false);
-				if (h->remote_socket == -1){
-					goto send_failure;
-				}
-				else{
-					hck.sockets[h->remote_socket] = h;
-				}
+static uint64_t monotonic_ns(){
+	struct timespec ts;
 
-				return;
-			}
-		}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char* trim(char* s){
+	char* e;
+
+	while (isspace((unsigned char)*s)){
+		s++;
 	}
+	e = s + strlen(s);
+	while (e > s && isspace((unsigned char)e[-1])){
+		*--e = 0;
+	}
+	return s;
+}
 
+/*
+Read Key=Value pairs in the style of the zabbix configuration files. A missing
+file is not an error, the defaults are used.
+*/
+static void load_config(const char* path){
+	char line[1024];
+	char *key, *value, *eq;
+	FILE* f;
 
-	/* Do not pass go, do not collect $200 */
-	/* An error has occured on the socket, time to cleanup */
-	if (e.events & EPOLLERR){
-		if (h->state == hck_details::keepalive){
-			zabbix_log(LOG_LEVEL_WARNING, "Closing HTTP keepalive connection due to error");
-			http_cleanup(hck, h);
-		}
-		else{
-			recv(e.data.fd, 0, 0, 0);
-			zabbix_log(LOG_LEVEL_WARNING, "Sending failure due to error: %s", strerror(errno));
-			goto send_failure;
-		}
+	f = fopen(path, "r");
+	if (f == NULL){
 		return;
 	}
 
-	if (h->state == hck_details::writing){
-		rc = send(e.data.fd, http_request + h->position, http_request_size - h->position, 0);
-		if (rc == -1){
-			if (errno == EAGAIN || errno == EWOULDBLOCK){
-				return;
-			}
-			zabbix_log(LOG_LEVEL_WARNING, "HCK: failed to send data (%s)\n", strerror(errno));
-			if (!h->first){
-				goto send_retry;
-			}
-			goto send_failure;
+	while (fgets(line, sizeof(line), f) != NULL){
+		key = trim(line);
+		if (*key == '#' || *key == 0){
+			continue;
 		}
-		h->position += rc;
-		if (h->position == http_request_size){
-			h->state = hck_details::reading1;
-			h->position = 0;
 
-			e.events = EPOLLIN;
-			rc = epoll_ctl(hck.epfd, EPOLL_CTL_MOD, e.data.fd, &e);
-			if (rc < 0)
-			{
-				zabbix_log(LOG_LEVEL_WARNING, "epoll mod error: %s", strerror(errno));
+		eq = strchr(key, '=');
+		if (eq == NULL){
+			zabbix_log(LOG_LEVEL_WARNING, "HCK: ignoring invalid configuration line: %s", key);
+			continue;
+		}
+		*eq = 0;
+		key = trim(key);
+		value = trim(eq + 1);
+
+		if (strcmp(key, "Workers") == 0){
+			config.workers = atoi(value);
+			if (config.workers < 1 || config.workers > HCK_MAX_WORKERS){
+				zabbix_log(LOG_LEVEL_WARNING, "HCK: Workers must be between 1 and %d", HCK_MAX_WORKERS);
+				config.workers = config.workers < 1 ? 1 : HCK_MAX_WORKERS;
 			}
 		}
-	}
-	else if (h->state == hck_details::reading1){
-		int i = http_resp_startlen - h->position;
-		rc = recv(e.data.fd, respbuff, sizeof(respbuff), 0);
-
-		if (rc  == -1){
+		else if (strcmp(key, "WorkerCpus") == 0){
+			// comma separated list, worker n is pinned to entry n modulo the list length
+			config.worker_cpus_count = 0;
+			for (char* tok = strtok(value, ","); tok != NULL && config.worker_cpus_count < HCK_MAX_WORKERS; tok = strtok(NULL, ",")){
+				config.worker_cpus[config.worker_cpus_count++] = atoi(trim(tok));
+			}
+		}
+		else if (strcmp(key, "TimeoutNew") == 0){
+			config.timeout_new = atoi(value);
+		}
+		else if (strcmp(key, "TimeoutRecover") == 0){
+			config.timeout_recover = atoi(value);
+		}
+		else if (strcmp(key, "TimeoutPost") == 0){
+			config.timeout_post = atoi(value);
+		}
+		else if (strcmp(key, "TimeoutAdaptive") == 0){
+			config.timeout_adaptive = atoi(value) != 0;
+		}
+		else if (strcmp(key, "TimeoutMin") == 0){
+			config.timeout_min = max(1, atoi(value));
+		}
+		else if (strcmp(key, "KeepaliveMin") == 0){
+			config.keepalive_min = atoi(value);
+		}
+		else if (strcmp(key, "KeepaliveMax") == 0){
+			config.keepalive_max = atoi(value);
+		}
+		else if (strcmp(key, "DnsThreads") == 0){
+			config.dns_threads = max(1, atoi(value));
+		}
+		else if (strcmp(key, "DnsTtl") == 0){
+			config.dns_ttl = atoi(value);
+		}
+		else if (strcmp(key, "DnsNegativeTtl") == 0){
+			config.dns_negative_ttl = atoi(value);
+		}
+		else if (strcmp(key, "HappyEyeballsDelay") == 0){
+			config.happy_eyeballs_delay = max(0, atoi(value));
+		}
+		else if (strcmp(key, "Coalesce") == 0){
+			config.coalesce = atoi(value) != 0;
+		}
+		else if (strcmp(key, "Pipeline") == 0){
+			config.pipeline = atoi(value);
+			if (config.pipeline < 1 || config.pipeline > PIPELINE_MAX){
+				zabbix_log(LOG_LEVEL_WARNING, "HCK: Pipeline must be between 1 and %d", PIPELINE_MAX);
+				config.pipeline = config.pipeline < 1 ? 1 : PIPELINE_MAX;
+			}
+		}
+		else if (strcmp(key, "ResultCache") == 0){
+			config.result_cache = atoi(value);
+		}
+		else if (strcmp(key, "Schedule") == 0){
+			config.schedule = atoi(value) != 0;
+		}
+		else if (strcmp(key, "Backend") == 0){
+			if (strcmp(value, "epoll") == 0){
+				config.backend = BACKEND_EPOLL;
+			}
+			else if (strcmp(value, "io_uring") == 0){
+				config.backend = BACKEND_URING;
+			}
+			else{
+				zabbix_log(LOG_LEVEL_WARNING, "HCK: unknown Backend %s, using epoll", value);
+			}
+		}
+		else if (strcmp(key, "EdgeTriggered") == 0){
+			config.edge_triggered = atoi(value) != 0;
+		}
+		else if (strcmp(key, "Socket") == 0){
+			if (*value == 0 || strlen(value) >= SOCKET_NAME_MAX){
+				zabbix_log(LOG_LEVEL_WARNING, "HCK: Socket must be 1 to %d characters", SOCKET_NAME_MAX - 1);
+			}
+			else{
+				snprintf(config.socket_name, sizeof(config.socket_name), "%s", value);
+			}
+		}
+		else if (strcmp(key, "ListenBacklog") == 0){
+			config.listen_backlog = max(1, atoi(value));
+		}
+		else if (strcmp(key, "Daemon") == 0){
+			config.daemon = atoi(value) != 0;
+		}
+		else if (strcmp(key, "StateFile") == 0){
+			config.state_file = value;
+		}
+		else if (strcmp(key, "WarmRate") == 0){
+			config.warm_rate = max(1, atoi(value));
+		}
+		else if (strcmp(key, "FdBudget") == 0){
+			config.fd_budget = max(0, atoi(value));
+		}
+		else{
+			zabbix_log(LOG_LEVEL_WARNING, "HCK: unknown configuration parameter %s", key);
+		}
+	}
+
+	fclose(f);
+}
+
+// normalized remote address (family, address, port), padding is always zero
+struct hck_addr {
+	uint8_t addr[16];
+	uint16_t port;
+	uint8_t family;
+	uint8_t pad;
+
+	bool operator==(const hck_addr& rhs) const {
+		return memcmp(this, &rhs, sizeof(*this)) == 0;
+	}
+};
+
+struct hck_addr_hash {
+	size_t operator()(const hck_addr& a) const {
+		return hck_hash(&a, sizeof(a));
+	}
+};
+
+struct hck_target_key {
+	struct hck_addr addr;
+	struct hck_spec* spec;
+
+	bool operator==(const hck_target_key& o) const {
+		return addr == o.addr && spec == o.spec;
+	}
+};
+
+struct hck_target_key_hash {
+	size_t operator()(const hck_target_key& k) const {
+		return hck_hash(&k.spec, sizeof(k.spec), hck_hash(&k.addr, sizeof(k.addr)));
+	}
+};
+
+static const uint8_t v4mapped_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+// IPv4-mapped IPv6 addresses are stored as IPv4 so both forms share a keepalive
+static bool addr_from_sockaddr(const struct sockaddr* sa, struct hck_addr* a){
+	memset(a, 0, sizeof(*a));
+
+	if (sa->sa_family == AF_INET){
+		const struct sockaddr_in* in = (const struct sockaddr_in*)sa;
+		a->family = AF_INET;
+		a->port = in->sin_port;
+		memcpy(a->addr, &in->sin_addr, 4);
+		return true;
+	}
+
+	if (sa->sa_family == AF_INET6){
+		const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)sa;
+		a->port = in6->sin6_port;
+		if (memcmp(&in6->sin6_addr, v4mapped_prefix, sizeof(v4mapped_prefix)) == 0){
+			a->family = AF_INET;
+			memcpy(a->addr, (const uint8_t*)&in6->sin6_addr + 12, 4);
+		}
+		else{
+			a->family = AF_INET6;
+			memcpy(a->addr, &in6->sin6_addr, 16);
+		}
+		return true;
+	}
+
+	return false;
+}
+
+static socklen_t addr_to_sockaddr(const struct hck_addr& a, struct sockaddr_storage* ss){
+	memset(ss, 0, sizeof(*ss));
+
+	if (a.family == AF_INET6){
+		struct sockaddr_in6* in6 = (struct sockaddr_in6*)ss;
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = a.port;
+		memcpy(&in6->sin6_addr, a.addr, 16);
+		return sizeof(*in6);
+	}
+
+	struct sockaddr_in* in = (struct sockaddr_in*)ss;
+	in->sin_family = AF_INET;
+	in->sin_port = a.port;
+	memcpy(&in->sin_addr, a.addr, 4);
+	return sizeof(*in);
+}
+
+/*
+IPC protocol between the module and the workers. Every message is a frame
+header followed by length bytes of payload. Both ends run on the same host,
+so fields are in host byte order. Replies carry the id of their request and
+may arrive in any order.
+*/
+#define HCK_PROTOCOL_VERSION 1
+#define HCK_MAX_PAYLOAD 4096
+
+enum hck_msg {
+	HCK_MSG_CHECK = 1,	// "host\0port\0" optionally followed by "method\0path\0hostheader\0budget\0interval\0", answered by HCK_MSG_RESULT
+	HCK_MSG_RESULT = 2,	// uint16_t, one of hck_result
+	HCK_MSG_LATENCY = 3,	// "host\0port\0phase\0stat\0connection\0", answered by HCK_MSG_VALUE
+	HCK_MSG_VALUE = 4,	// uint64_t, or nothing if there is no value
+	HCK_MSG_STATS = 5,	// "metric\0", answered by HCK_MSG_VALUE
+	HCK_MSG_BULK = 6,	// "budget\0" followed by "host\0port\0" for each target, answered by HCK_MSG_RESULTS
+	HCK_MSG_RESULTS = 7	// uint16_t for each target of a bulk request, in its order
+};
+
+enum hck_result {
+	HCK_RESULT_FAIL = 0,
+	HCK_RESULT_OK = 1,
+	HCK_RESULT_OVERLOADED = 3,	// not checked, the worker has no socket to spare
+	HCK_RESULT_ERROR = 4,	// module side only, the worker could not be reached
+	HCK_RESULT_NO_WORKER = 5,	// module side only, no connection to the worker
+	HCK_RESULT_TIMEOUT = 6	// module side only, no reply from the worker within the item timeout
+};
+
+struct hck_frame {
+	uint8_t version;
+	uint8_t type;
+	uint16_t length;
+	uint32_t id;
+};
+
+struct hck_bulk;
+struct hck_race;
+
+// a connection from a poller, each check waiting on it holds a reference
+struct hck_client {
+	int fd;
+	unsigned int refs;
+	bool closed;
+	vector<char> in;
+	vector<char> out;
+	struct hck_bulk* bulk;	// not a connection, collects the answers to a bulk request by index
+	struct hck_race* race;	// not a connection, collects the answers from the addresses of a race by index
+};
+
+// a bulk request, answered once every target in it is
+struct hck_bulk {
+	struct hck_client* client;	// the poller's connection
+	uint32_t id;
+	unsigned int pending;
+	vector<uint16_t> results;
+};
+
+struct hck_details;
+
+/* Latency phases, each timed from the start of the request */
+enum hck_phase {
+	PHASE_CONNECT = 0,	// connection established, new connections only
+	PHASE_WRITE = 1,	// first byte of the request sent
+	PHASE_READ = 2,	// first byte of the response received
+	PHASE_HEADER = 3,	// response header complete
+	PHASE_COUNT = 4
+};
+
+static const char* latency_phases[PHASE_COUNT] = { "connect", "write", "firstbyte", "header" };
+
+/* Requests on new connections and on reused (keepalive or pipelined) ones are kept apart */
+enum hck_kind {
+	KIND_NEW = 0,
+	KIND_REUSED = 1,
+	KIND_ALL = 2	// queries only
+};
+
+/*
+Log scale latency histogram, four buckets per power of two from 1us to about a
+minute, so quantiles are within 12%. Counts are halved whenever a window of
+samples has been added, older checks fade out.
+*/
+#define HIST_SHIFT 10	// everything below 2^10 ns shares the first bucket
+#define HIST_SUB 4
+#define HIST_BUCKETS (26 * HIST_SUB)
+#define HIST_WINDOW 1024
+
+struct hck_histogram {
+	uint16_t counts[HIST_BUCKETS];
+	uint16_t total;
+};
+
+static int hist_bucket(uint64_t ns){
+	int e;
+
+	if (ns < (1ull << HIST_SHIFT)){
+		return 0;
+	}
+	e = 63 - __builtin_clzll(ns);
+	return min((e - HIST_SHIFT) * HIST_SUB + (int)((ns >> (e - 2)) & (HIST_SUB - 1)), HIST_BUCKETS - 1);
+}
+
+// the middle of a bucket
+static uint64_t hist_value(int bucket){
+	int e = bucket / HIST_SUB + HIST_SHIFT;
+
+	return (uint64_t)(2 * (HIST_SUB + bucket % HIST_SUB) + 1) << (e - 3);
+}
+
+static void hist_add(struct hck_histogram* h, uint64_t ns){
+	if (h->total >= HIST_WINDOW){
+		h->total = 0;
+		for (int i = 0; i < HIST_BUCKETS; i++){
+			h->counts[i] /= 2;
+			h->total += h->counts[i];
+		}
+	}
+	h->counts[hist_bucket(ns)]++;
+	h->total++;
+}
+
+// the q quantile (0 < q <= 1) over one or two histograms, 0 if they are empty
+static uint64_t hist_quantile(const struct hck_histogram* a, const struct hck_histogram* b, double q){
+	unsigned int total = a->total + (b != NULL ? b->total : 0);
+	unsigned int rank, seen = 0;
+
+	if (total == 0){
+		return 0;
+	}
+	rank = max(1u, (unsigned int)(q * total + 0.999999));
+	for (int i = 0; i < HIST_BUCKETS; i++){
+		seen += a->counts[i] + (b != NULL ? b->counts[i] : 0);
+		if (seen >= rank){
+			return hist_value(i);
+		}
+	}
+	return hist_value(HIST_BUCKETS - 1);
+}
+
+// latency of the checks on an address, whatever request they send
+struct hck_latency {
+	uint64_t last[3][PHASE_COUNT];	// by hck_kind, 0 until measured
+	struct hck_histogram hist[2][PHASE_COUNT];
+	unsigned int refs;	// targets using it
+	uint64_t last_used;
+};
+
+// when the request on a check socket reached each phase, ns, 0 until it has
+struct hck_timing {
+	uint64_t start;
+	uint64_t at[PHASE_COUNT];
+};
+
+// latency query parameters, shared by the module and the workers. The phase is required
+static int latency_phase(const char* s){
+	for (int i = 0; s != NULL && i < PHASE_COUNT; i++){
+		if (strcmp(s, latency_phases[i]) == 0){
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int latency_kind(const char* s){
+	if (s == NULL || *s == 0 || strcmp(s, "all") == 0){
+		return KIND_ALL;
+	}
+	if (strcmp(s, "new") == 0){
+		return KIND_NEW;
+	}
+	if (strcmp(s, "reused") == 0){
+		return KIND_REUSED;
+	}
+	return -1;
+}
+
+// "last" (the default) gives 0, "pN" the quantile N / 100
+static bool latency_stat(const char* s, double* q){
+	char* end;
+
+	if (s == NULL || *s == 0 || strcmp(s, "last") == 0){
+		*q = 0;
+		return true;
+	}
+	if (*s != 'p'){
+		return false;
+	}
+	*q = strtod(s + 1, &end) / 100;
+	return end != s + 1 && *end == 0 && *q > 0 && *q <= 1;
+}
+
+// smoothed round trip time and its variation (us) as TCP keeps them (RFC 6298), srtt 0 until measured
+struct hck_rtt {
+	uint32_t srtt;
+	uint32_t rttvar;
+};
+
+#define RTT_GRANULARITY 1000	// the least variation allowed for (us)
+
+static void rtt_sample(struct hck_rtt* r, uint64_t ns){
+	uint32_t us = (uint32_t)min(ns / 1000, (uint64_t)UINT32_MAX / 8);
+
+	if (us == 0){
+		us = 1;
+	}
+	if (r->srtt == 0){
+		r->srtt = us;
+		r->rttvar = us / 2;
+		return;
+	}
+	r->rttvar = (3 * (uint64_t)r->rttvar + (r->srtt > us ? r->srtt - us : us - r->srtt)) / 4;
+	r->srtt = (7 * (uint64_t)r->srtt + us) / 8;
+}
+
+// the retransmission timeout of an estimate (us), 0 if there is none
+static uint64_t rtt_timeout(const struct hck_rtt* r){
+	return r->srtt == 0 ? 0 : r->srtt + max((uint64_t)RTT_GRANULARITY, 4 * (uint64_t)r->rttvar);
+}
+
+// a check timed out after timeout ms, wait at least as long again next time, up to limit ms, until a response says otherwise
+static void rtt_backoff(struct hck_rtt* r, uint64_t timeout, int limit){
+	if (r->srtt != 0){
+		r->srtt = (uint32_t)min(max(2 * (uint64_t)r->srtt, timeout * 1000), (uint64_t)limit * 1000);
+	}
+}
+
+/* What a target made of TCP Fast Open on the last new connection that told */
+enum hck_tfo {
+	TFO_UNKNOWN = 0,
+	TFO_NO_COOKIE = 1,	// a cookie was asked for, the request went after the handshake
+	TFO_ACCEPTED = 2,	// the request went in the SYN and the server took it
+	TFO_FALLBACK = 3	// no cookie again, the data in the SYN was ignored, or the connect failed. Not used until tfo_retry_at
+};
+
+// a check request (method, path and Host) and its bytes, shared by the targets sending it
+struct hck_spec {
+	string key;	// "method\0path\0host\0"
+	string request;
+	bool head;	// responses have no body
+	unsigned int refs;	// targets using it
+	uint64_t last_used;
+};
+
+// a remote address checked with one request, and its pool of idle keepalive connections
+struct hck_target {
+	struct hck_addr addr;
+	struct hck_spec* spec;
+	struct sockaddr_storage sockaddr;	// addr for connect, also read by queued io_uring connects
+	socklen_t sockaddr_len;
+	vector<struct hck_details*> idle;	// LIFO, the most recently used is at the back
+	unsigned int connections;	// open connections, including idle ones
+	uint64_t last_used;
+	struct hck_details* inflight;	// the latest check still waiting on the target, new requests join it
+	bool persistent;	// the last response left its connection open, requests may be pipelined
+	struct hck_latency* latency;	// shared by the targets on the address
+	struct hck_rtt connect_rtt;	// handshakes of new connections
+	struct hck_rtt response_rtt;	// from the request going out to the response header
+	uint8_t tfo;	// one of hck_tfo
+	uint64_t tfo_since;	// ns, when the cookie was asked for
+	uint64_t tfo_retry_at;	// ms, when TCP Fast Open is tried again after a fallback
+	uint16_t last_result;
+	uint16_t last_status;	// status code of the last complete response, 0 if none
+	uint64_t last_result_at;	// 0 if there is no result yet
+	uint64_t last_request;	// when a poller last asked for the target, 0 never
+	uint32_t interval;	// the target is checked this often on its own (ms), 0 if it is not scheduled
+	uint64_t next_run;	// when the schedule checks it next, 0 if it is not scheduled
+};
+
+// a client request waiting on a check or a resolution, pooled
+struct hck_waiter {
+	struct hck_client* client;
+	struct hck_spec* spec;	// while waiting on a host
+	uint64_t deadline;	// of the request, while waiting on a host
+	uint32_t interval;	// registered by the request, while waiting on a host
+	uint32_t id;
+	struct hck_waiter* next;
+	struct hck_waiter* next_free;
+};
+
+// a host name and its cached resolution
+struct hck_host {
+	string name;
+	string port;
+	vector<struct hck_addr> addrs;	// empty for a negative entry
+	uint64_t expires;	// refreshed after this, but still served until replaced
+	uint64_t resolve_started;
+	uint64_t last_used;
+	bool resolving;
+	bool resolved;
+	struct hck_waiter* waiting;	// requests waiting for the first resolution
+	struct hck_addr preferred;	// the address that won the last race, tried first. Family 0 for none
+};
+
+/*
+A request to a host with several addresses, raced across them (RFC 8305):
+the addresses are tried one after another, HappyEyeballsDelay apart or at once
+when one fails, and the first to answer OK answers the request.
+*/
+struct hck_race {
+	struct hck_client* client;	// whoever made the request
+	uint32_t id;
+	struct hck_client* collect;	// takes the answers, gone once the race is decided
+	string key;	// of the host, to remember the winner
+	struct hck_spec* spec;
+	vector<struct hck_addr> addrs;	// in the order they are tried
+	size_t next;	// addresses tried so far
+	unsigned int pending;	// tries not answered yet
+	uint64_t next_at;	// when the next address is tried
+	uint64_t deadline;	// of the request
+	uint32_t interval;	// registered by the request
+	uint16_t result;	// of the latest try
+	bool done;
+};
+
+// receive buffer for a check on the io_uring backend, pooled
+struct hck_rbuf {
+	char data[READSIZE];
+	struct hck_rbuf* next_free;
+};
+
+// a check, sized to a single cache line
+struct __attribute__((aligned(CACHE_LINE))) hck_details {
+	union {
+		struct hck_details* next_free;	// while pooled
+		struct hck_waiter* queued;	// pipelined requests behind the current one, a waiter each, oldest first
+	};
+	uint64_t expires;
+	struct hck_waiter* waiters;
+	struct hck_target* target;
+	struct hck_rbuf* rbuf;	// io_uring only, held while a receive may be queued
+	uint32_t generation;
+	int remote_socket;
+	unsigned short position : 14;	// bytes sent of the current request and the queued ones after it
+	enum {
+		connecting = 1,
+		writing = 2,
+		reading = 3,
+		keepalive = 4,
+		recovery = 5
+	} state: 3;
+	unsigned int pipelined : 3;	// requests queued
+	bool first : 1;
+	bool tfo : 1;
+	bool polling : 1;	// io_uring only, an idle poll is queued
+	bool released : 1;	// io_uring only, freed once the pending operations complete
+	unsigned int pending : 6;	// io_uring operations not completed yet
+	struct hck_resp resp;
+};
+static_assert(sizeof(struct hck_details) == CACHE_LINE, "hck_details should fit a cache line");
+
+// pooled storage for fixed size records, chunks are kept for the life of the worker
+template <class T>
+class hck_slab {
+public:
+	hck_slab() : free_list(NULL) {}
+	~hck_slab(){
+		for (size_t i = 0; i < chunks.size(); i++){
+			free(chunks[i]);
+		}
+	}
+
+	T* alloc(){
+		T* h;
+
+		if (free_list == NULL && !grow()){
+			return NULL;
+		}
+
+		h = free_list;
+		free_list = h->next_free;
+		return h;
+	}
+
+	void release(T* h){
+		h->next_free = free_list;
+		free_list = h;
+	}
+
+	size_t capacity() const {
+		return chunks.size() * SLAB_SIZE;
+	}
+
+private:
+	bool grow(){
+		void* mem;
+
+		if (posix_memalign(&mem, CACHE_LINE, SLAB_SIZE * sizeof(T)) != 0){
+			return false;
+		}
+		memset(mem, 0, SLAB_SIZE * sizeof(T));
+		chunks.push_back((T*)mem);
+
+		T* chunk = (T*)mem;
+		for (int i = SLAB_SIZE - 1; i >= 0; i--){
+			release(&chunk[i]);
+		}
+		return true;
+	}
+
+	T* free_list;
+	vector<T*> chunks;
+};
+
+// records indexed directly by their socket
+template <class T>
+class hck_fdtable {
+public:
+	hck_fdtable() : count(0) {}
+
+	T* find(int fd) const {
+		return (size_t)fd < table.size() ? table[fd] : NULL;
+	}
+
+	void insert(int fd, T* h){
+		if ((size_t)fd >= table.size()){
+			table.resize(max((size_t)fd + 1, table.size() * 2), NULL);
+		}
+		assert(table[fd] == NULL);
+		table[fd] = h;
+		count++;
+	}
+
+	int erase(int fd){
+		if ((size_t)fd >= table.size() || table[fd] == NULL){
+			return 0;
+		}
+		table[fd] = NULL;
+		count--;
+		return 1;
+	}
+
+	// upper bound for iterating with find()
+	int limit() const {
+		return table.size();
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+private:
+	vector<T*> table;
+	size_t count;
+};
+
+/*
+Check deadlines as a min-heap with lazy deletion. Rescheduling pushes a new
+entry, entries whose check has since been released or given another deadline
+are skipped when they reach the top.
+*/
+class hck_timers {
+public:
+	void schedule(struct hck_details* h){
+		struct entry t = { h->expires, h->generation, h };
+
+		heap.push_back(t);
+		push_heap(heap.begin(), heap.end());
+	}
+
+	// deadline of the next live entry, or 0 if there is none
+	uint64_t next(){
+		discard_stale();
+		return heap.empty() ? 0 : heap.front().expires;
+	}
+
+	// the next check due at now, or NULL
+	struct hck_details* pop(uint64_t now){
+		struct hck_details* h;
+
+		discard_stale();
+		if (heap.empty() || heap.front().expires > now){
+			return NULL;
+		}
+
+		h = heap.front().h;
+		pop_heap(heap.begin(), heap.end());
+		heap.pop_back();
+		return h;
+	}
+
+	// drop stale entries once they outnumber the live checks
+	void compact(size_t live){
+		if (heap.size() < 1024 || heap.size() < live * 4){
+			return;
+		}
+		heap.erase(remove_if(heap.begin(), heap.end(), stale), heap.end());
+		make_heap(heap.begin(), heap.end());
+	}
+
+private:
+	struct entry {
+		uint64_t expires;
+		uint32_t generation;
+		struct hck_details* h;
+
+		// std heaps keep the largest entry on top
+		bool operator<(const entry& rhs) const {
+			return expires > rhs.expires;
+		}
+	};
+
+	static bool stale(const entry& t){
+		return t.generation != t.h->generation || t.expires != t.h->expires;
+	}
+
+	void discard_stale(){
+		while (!heap.empty() && stale(heap.front())){
+			pop_heap(heap.begin(), heap.end());
+			heap.pop_back();
+		}
+	}
+
+	vector<entry> heap;
+};
+
+/*
+When the scheduled targets are checked next, a min-heap keyed by target so an
+entry never outlives its target. Entries whose target has gone or has been
+given another run are skipped.
+*/
+class hck_schedule {
+public:
+	void add(const struct hck_target_key& key, uint64_t due){
+		struct entry r = { due, key };
+
+		heap.push_back(r);
+		push_heap(heap.begin(), heap.end());
+	}
+
+	// the earliest run, or 0 if there is none
+	uint64_t next() const {
+		return heap.empty() ? 0 : heap.front().due;
+	}
+
+	// the next run due at now, false if there is none
+	bool pop(uint64_t now, struct hck_target_key* key, uint64_t* due){
+		if (heap.empty() || heap.front().due > now){
+			return false;
+		}
+
+		*key = heap.front().key;
+		*due = heap.front().due;
+		pop_heap(heap.begin(), heap.end());
+		heap.pop_back();
+		return true;
+	}
+
+private:
+	struct entry {
+		uint64_t due;
+		struct hck_target_key key;
+
+		bool operator<(const entry& rhs) const {
+			return due > rhs.due;
+		}
+	};
+
+	vector<entry> heap;
+};
+
+/*
+getaddrinfo on a few threads of the worker, so a slow resolver never blocks
+the event loop. Completions are signalled through an eventfd.
+*/
+class hck_resolver {
+public:
+	struct result {
+		string key;
+		vector<struct hck_addr> addrs;
+	};
+
+	hck_resolver() : fd(-1), stopping(false) {
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&cond, NULL);
+	}
+
+	~hck_resolver(){
+		stop();
+		pthread_mutex_destroy(&lock);
+		pthread_cond_destroy(&cond);
+	}
+
+	bool start(int count){
+		pthread_t thread;
+
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fd == -1){
+			return false;
+		}
+
+		for (int i = 0; i < count; i++){
+			if (pthread_create(&thread, NULL, run, this) != 0){
+				zabbix_log(LOG_LEVEL_WARNING, "HCK: unable to start resolver thread: %s", strerror(errno));
+				break;
+			}
+			threads.push_back(thread);
+		}
+		return !threads.empty();
+	}
+
+	void stop(){
+		pthread_mutex_lock(&lock);
+		stopping = true;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+
+		for (size_t i = 0; i < threads.size(); i++){
+			pthread_join(threads[i], NULL);
+		}
+		threads.clear();
+
+		if (fd != -1){
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	// key is the name and port separated by a NUL
+	void submit(const string& key){
+		pthread_mutex_lock(&lock);
+		jobs.push_back(key);
+		pthread_cond_signal(&cond);
+		pthread_mutex_unlock(&lock);
+	}
+
+	// take the finished resolutions
+	void collect(vector<result>& out){
+		uint64_t count;
+
+		if (read(fd, &count, sizeof(count)) != sizeof(count)){
+			return;
+		}
+
+		pthread_mutex_lock(&lock);
+		out.swap(results);
+		pthread_mutex_unlock(&lock);
+	}
+
+	int fd;
+
+private:
+	static void* run(void* arg){
+		hck_resolver* r = (hck_resolver*)arg;
+		struct addrinfo hints, *servinfo, *ai;
+		struct hck_addr addr;
+		uint64_t one = 1;
+		result res;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		pthread_mutex_lock(&r->lock);
+		for (;;){
+			while (r->jobs.empty() && !r->stopping){
+				pthread_cond_wait(&r->cond, &r->lock);
+			}
+			if (r->stopping){
+				break;
+			}
+			res.key = r->jobs.front();
+			r->jobs.pop_front();
+			pthread_mutex_unlock(&r->lock);
+
+			res.addrs.clear();
+			if (getaddrinfo(res.key.c_str(), res.key.c_str() + strlen(res.key.c_str()) + 1, &hints, &servinfo) == 0){
+				for (ai = servinfo; ai != NULL; ai = ai->ai_next){
+					if (addr_from_sockaddr(ai->ai_addr, &addr) && find(res.addrs.begin(), res.addrs.end(), addr) == res.addrs.end()){
+						res.addrs.push_back(addr);
+					}
+				}
+				freeaddrinfo(servinfo);
+			}
+
+			pthread_mutex_lock(&r->lock);
+			r->results.push_back(res);
+			if (write(r->fd, &one, sizeof(one)) != sizeof(one)){
+				zabbix_log(LOG_LEVEL_WARNING, "HCK: unable to signal resolver completion");
+			}
+		}
+		pthread_mutex_unlock(&r->lock);
+
+		return NULL;
+	}
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stopping;
+	deque<string> jobs;
+	vector<result> results;
+	vector<pthread_t> threads;
+};
+
+#ifdef HCK_IO_URING
+/* completion tags, kept in the low bits of the io_uring user data next to the check */
+enum hck_uring_op {
+	URING_CONNECT = 1,
+	URING_SEND = 2,
+	URING_RECV = 3,
+	URING_POLL = 4,
+	URING_EPOLL = 5,	// the epoll set of the internal sockets became readable
+	URING_OP_MASK = 63	// below the alignment of hck_details
+};
+
+/*
+A minimal io_uring, set up with the raw system calls. Submissions are queued
+with sqe() and handed to the kernel with the next wait(), or submit() when
+they cannot wait.
+*/
+class hck_ring {
+public:
+	hck_ring() : fd(-1), ring(NULL), sqes(NULL) {}
+	~hck_ring(){
+		teardown();
+	}
+
+	bool setup(unsigned entries){
+		struct io_uring_params p;
+
+		memset(&p, 0, sizeof(p));
+		fd = syscall(__NR_io_uring_setup, entries, &p);
+		if (fd < 0){
+			return false;
+		}
+		if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)){
+			teardown();
+			errno = ENOSYS;
+			return false;
+		}
+
+		ring_size = max(p.sq_off.array + p.sq_entries * sizeof(unsigned), p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+		ring = mmap(0, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		if (ring == MAP_FAILED){
+			ring = NULL;
+			teardown();
+			return false;
+		}
+		sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+		sqes = (struct io_uring_sqe*)mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED){
+			sqes = NULL;
+			teardown();
+			return false;
+		}
+
+		sq_head = (unsigned*)((char*)ring + p.sq_off.head);
+		sq_tail = (unsigned*)((char*)ring + p.sq_off.tail);
+		sq_mask = *(unsigned*)((char*)ring + p.sq_off.ring_mask);
+		sq_entries = p.sq_entries;
+		cq_head = (unsigned*)((char*)ring + p.cq_off.head);
+		cq_tail = (unsigned*)((char*)ring + p.cq_off.tail);
+		cq_mask = *(unsigned*)((char*)ring + p.cq_off.ring_mask);
+		cqes = (struct io_uring_cqe*)((char*)ring + p.cq_off.cqes);
+
+		/* Submission slots are used in order */
+		unsigned* array = (unsigned*)((char*)ring + p.sq_off.array);
+		for (unsigned i = 0; i < sq_entries; i++){
+			array[i] = i;
+		}
+		tail = *sq_tail;
+
+		return true;
+	}
+
+	void teardown(){
+		if (sqes != NULL){
+			munmap(sqes, sqes_size);
+			sqes = NULL;
+		}
+		if (ring != NULL){
+			munmap(ring, ring_size);
+			ring = NULL;
+		}
+		if (fd != -1){
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	// a cleared submission entry, the queue is submitted first if it is full
+	struct io_uring_sqe* sqe(){
+		struct io_uring_sqe* e;
+
+		while (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries){
+			submit();
+		}
+
+		e = &sqes[tail & sq_mask];
+		memset(e, 0, sizeof(*e));
+		tail++;
+		return e;
+	}
+
+	unsigned queued() const {
+		return tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	}
+
+	int submit(){
+		return enter(0, 0, -1);
+	}
+
+	// submit the queue and wait up to timeout ms (-1 forever) for a completion
+	int wait(int timeout){
+		return enter(1, IORING_ENTER_GETEVENTS, timeout);
+	}
+
+	// the next completion, if any, consumed by advance()
+	struct io_uring_cqe* peek(){
+		if (*cq_head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)){
+			return NULL;
+		}
+		return &cqes[*cq_head & cq_mask];
+	}
+
+	void advance(){
+		__atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+	}
+
+	int fd;
+
+private:
+	int enter(unsigned min_complete, unsigned flags, int timeout){
+		struct io_uring_getevents_arg arg;
+		struct __kernel_timespec ts;
+		int rc;
+
+		__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+		memset(&arg, 0, sizeof(arg));
+		if (timeout >= 0){
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000L;
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+		}
+
+		counters.uring_enter++;
+		rc = syscall(__NR_io_uring_enter, fd, queued(), min_complete, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		if (rc < 0 && errno != ETIME && errno != EINTR && errno != EBUSY){
+			zabbix_log(LOG_LEVEL_WARNING, "HCK: io_uring_enter failed: %s", strerror(errno));
+		}
+		return rc;
+	}
+
+	void* ring;
+	size_t ring_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned tail;	// local tail, published on enter
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+};
+#endif
+
+// the hck system (could be exported outside of zabbix in future)
+class hck_handle {
+public:
+	int epfd;
+	hck_fdtable<struct hck_details> sockets;
+	hck_fdtable<struct hck_client> clients;
+	hck_slab<struct hck_details> slab;
+	hck_slab<struct hck_waiter> waiter_slab;
+	hck_timers timers;
+	hck_timers idle_lru;	// pooled connections by when they went idle, the least recently used on top
+	size_t fd_budget;	// check sockets that may be open
+	unordered_map<struct hck_target_key, struct hck_target*, struct hck_target_key_hash> targets;
+	unordered_map<string, struct hck_spec*> specs;
+	unordered_map<struct hck_addr, struct hck_latency*, struct hck_addr_hash> latency;
+	vector<struct hck_timing> timings;	// by check socket, for the request on it
+	unordered_map<string, struct hck_host*> hosts;
+	string scratch;	// lookup keys are built here, so finding an entry does not allocate
+	uint64_t deadline;	// of the request being handled, checks it starts expire by then. 0 for none
+	uint32_t interval;	// registered by the request being handled (ms), 0 to learn it
+	hck_schedule schedule;
+	uint32_t seed;	// jitter of the scheduled runs
+	string state_path;	// where the targets are saved, empty if they are not
+	uint64_t next_state_save;
+	uint32_t state_hash;	// of the targets last saved, latency aside
+	deque<struct hck_target_key> warm;	// saved targets still to be connected to
+	uint64_t warm_started;
+	uint64_t warm_done;
+	vector<struct hck_host*> resolving;
+	vector<struct hck_race*> races;	// decided ones are dropped by handle_races
+	hck_resolver resolver;
+	uint64_t next_target_sweep;
+	int backend;
+	bool edge;	// check sockets are edge triggered on epoll
+#ifdef HCK_IO_URING
+	hck_ring ring;
+	hck_slab<struct hck_rbuf> rbufs;
+#endif
+};
+
+static struct hck_target* target_get(hck_handle* hck, const struct hck_addr& addr, struct hck_spec* spec, uint64_t now){
+	struct hck_target_key key;
+
+	key.addr = addr;
+	key.spec = spec;
+	struct hck_target*& t = hck->targets[key];
+
+	if (t == NULL){
+		t = new struct hck_target;
+		t->addr = addr;
+		t->spec = spec;
+		spec->refs++;
+		t->sockaddr_len = addr_to_sockaddr(addr, &t->sockaddr);
+		t->connections = 0;
+		t->inflight = NULL;
+		t->persistent = false;
+
+		struct hck_latency*& latency = hck->latency[addr];
+		if (latency == NULL){
+			latency = new struct hck_latency();
+		}
+		t->latency = latency;
+		latency->refs++;
+		latency->last_used = now;
+		t->last_result_at = 0;
+		t->last_status = 0;
+		t->last_request = 0;
+		t->interval = 0;
+		t->next_run = 0;
+		memset(&t->connect_rtt, 0, sizeof(t->connect_rtt));
+		memset(&t->response_rtt, 0, sizeof(t->response_rtt));
+		t->tfo = TFO_UNKNOWN;
+		t->tfo_since = 0;
+		t->tfo_retry_at = 0;
+	}
+	t->last_used = now;
+
+	return t;
+}
+
+static struct hck_target_key target_key(const struct hck_target* t){
+	struct hck_target_key key;
+
+	key.addr = t->addr;
+	key.spec = t->spec;
+	return key;
+}
+
+static struct hck_timing* timing_of(hck_handle* hck, int fd){
+	if ((size_t)fd >= hck->timings.size()){
+		hck->timings.resize(max((size_t)fd + 1, hck->timings.size() * 2));
+	}
+	return &hck->timings[fd];
+}
+
+// a request starts on a check socket, at start if it was taken before the socket existed
+static void timing_start(hck_handle* hck, struct hck_details* h, uint64_t start = 0){
+	struct hck_timing* tm = timing_of(hck, h->remote_socket);
+
+	memset(tm, 0, sizeof(*tm));
+	tm->start = start != 0 ? start : monotonic_ns();
+}
+
+// the request on a check socket reached a phase, only the first time counts
+static void timing_mark(hck_handle* hck, struct hck_details* h, int phase){
+	struct hck_timing* tm = &hck->timings[h->remote_socket];
+
+	if (tm->at[phase] == 0){
+		tm->at[phase] = monotonic_ns();
+	}
+}
+
+// add the phases of a finished request to the latency of its address
+static void latency_record(hck_handle* hck, struct hck_details* h, uint64_t now){
+	struct hck_timing* tm = &hck->timings[h->remote_socket];
+	struct hck_latency* l = h->target->latency;
+	int kind = h->first ? KIND_NEW : KIND_REUSED;
+
+	for (int i = kind == KIND_NEW ? PHASE_CONNECT : PHASE_WRITE; i < PHASE_COUNT; i++){
+		if (tm->at[i] != 0){
+			uint64_t ns = tm->at[i] - tm->start;
+			l->last[kind][i] = l->last[KIND_ALL][i] = ns;
+			hist_add(&l->hist[kind][i], ns);
+		}
+	}
+	l->last_used = now;
+
+	/* Round trips for the adaptive timeouts. With TCP Fast Open the handshake is not seen, and is part of the response time */
+	if (kind == KIND_NEW && tm->at[PHASE_CONNECT] != 0){
+		rtt_sample(&h->target->connect_rtt, tm->at[PHASE_CONNECT] - tm->start);
+	}
+	if (tm->at[PHASE_HEADER] != 0 && (kind == KIND_REUSED || tm->at[PHASE_CONNECT] != 0)){
+		uint64_t sent = tm->at[PHASE_WRITE] != 0 ? tm->at[PHASE_WRITE] : tm->start;
+		rtt_sample(&h->target->response_rtt, tm->at[PHASE_HEADER] - min(sent, tm->at[PHASE_HEADER]));
+	}
+}
+
+// stop using TCP Fast Open with a target for a while
+static void tfo_give_up(struct hck_target* t, uint64_t now){
+	t->tfo = TFO_FALLBACK;
+	t->tfo_retry_at = now + TFO_RETRY;
+}
+
+// should a new connection to the target try TCP Fast Open
+static bool tfo_wanted(const struct hck_target* t, uint64_t now){
+#ifdef MSG_FASTOPEN
+	return t->tfo != TFO_FALLBACK || now >= t->tfo_retry_at;
+#else
+	return false;
+#endif
+}
+
+/*
+The first response on a connection opened with TCP Fast Open tells what the
+target made of it. A request that went in the SYN was taken if the SYN-ACK
+acknowledged it. One that went after the handshake had no cookie to go with;
+a second connection in that state, started after the first one asked for a
+cookie, means the server does not hand them out.
+*/
+static void tfo_learn(hck_handle* hck, struct hck_details* h, uint64_t now){
+	struct hck_timing* tm = &hck->timings[h->remote_socket];
+	struct hck_target* t = h->target;
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	if (!h->first || !h->tfo){
+		return;
+	}
+
+	/* The handshake is only seen when the request waited for it */
+	if (tm->at[PHASE_CONNECT] == 0){
+		if (getsockopt(h->remote_socket, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 && (info.tcpi_options & TCPI_OPT_SYN_DATA)){
+			t->tfo = TFO_ACCEPTED;
+			counters.tfo_accepted++;
+		}
+		else{
+			tfo_give_up(t, now);
+		}
+	}
+	else if (t->tfo != TFO_NO_COOKIE){
+		t->tfo = TFO_NO_COOKIE;
+		t->tfo_since = tm->start;
+	}
+	else if (tm->start > t->tfo_since){
+		tfo_give_up(t, now);
+	}
+}
+
+/*
+How long a check on a new connection, or a reused one, may take (ms). Adaptive
+timeouts allow for the target's round trips as TCP would before retransmitting,
+between TimeoutMin and the configured timeout. A target not measured yet gets
+the configured one.
+*/
+static uint64_t timeout_for(const struct hck_target* t, bool connecting){
+	int limit = connecting ? config.timeout_new : config.timeout_recover;
+	uint64_t connect = rtt_timeout(&t->connect_rtt);
+	uint64_t response = rtt_timeout(&t->response_rtt);
+
+	if (!config.timeout_adaptive || response == 0 || (connecting && connect == 0)){
+		return limit;
+	}
+	if (connecting){
+		response += connect;
+	}
+	return min((uint64_t)limit, max((uint64_t)config.timeout_min, (response + 999) / 1000));
+}
+
+static void pool_remove(struct hck_target* t, struct hck_details* h){
+	vector<struct hck_details*>::iterator it = find(t->idle.begin(), t->idle.end(), h);
+
+	assert(it != t->idle.end());
+	t->idle.erase(it);
+}
+
+static void set_expiry(hck_handle* hck, struct hck_details* h, uint64_t expires){
+	h->expires = expires;
+	hck->timers.schedule(h);
+}
+
+// an idle connection in the pool expires at expires, and is evicted before those that went idle later
+static void pool_expiry(hck_handle* hck, struct hck_details* h, uint64_t expires){
+	set_expiry(hck, h, expires);
+	hck->idle_lru.schedule(h);
+}
+
+static void client_release(struct hck_client* c){
+	assert(c->refs > 0);
+	if (--c->refs == 0 && c->closed){
+		delete c;
+	}
+}
+
+static void client_close(hck_handle* hck, struct hck_client* c){
+	epoll_ctl(hck->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	hck->clients.erase(c->fd);
+	close(c->fd);
+
+	c->closed = true;
+	if (c->refs == 0){
+		delete c;
+	}
+}
+
+// queue data for a client, anything the socket does not take now goes out on EPOLLOUT
+static void client_write(hck_handle* hck, struct hck_client* c, const void* data, size_t len){
+	struct epoll_event e;
+	int rc = 0;
+
+	if (c->closed){
+		return;
+	}
+
+	if (c->out.empty()){
+		rc = send(c->fd, data, len, MSG_NOSIGNAL);
+		if (rc == -1){
+			if (errno != EAGAIN && errno != EWOULDBLOCK){
+				/* main_thread closes it on the hangup */
+				shutdown(c->fd, SHUT_RDWR);
+				return;
+			}
+			rc = 0;
+		}
+		if ((size_t)rc == len){
+			return;
+		}
+
+		e.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+		e.data.fd = c->fd;
+		epoll_ctl(hck->epfd, EPOLL_CTL_MOD, c->fd, &e);
+	}
+
+	c->out.insert(c->out.end(), (const char*)data + rc, (const char*)data + len);
+}
+
+static void client_flush(hck_handle* hck, struct hck_client* c){
+	struct epoll_event e;
+	int rc;
+
+	rc = send(c->fd, &c->out[0], c->out.size(), MSG_NOSIGNAL);
+	if (rc == -1){
+		if (errno != EAGAIN && errno != EWOULDBLOCK){
+			shutdown(c->fd, SHUT_RDWR);
+		}
+		return;
+	}
+
+	c->out.erase(c->out.begin(), c->out.begin() + rc);
+	if (c->out.empty()){
+		e.events = EPOLLIN | EPOLLRDHUP;
+		e.data.fd = c->fd;
+		epoll_ctl(hck->epfd, EPOLL_CTL_MOD, c->fd, &e);
+	}
+}
+
+// the answer for one target of a bulk request, the whole of it goes to the poller with the last
+static void bulk_result(hck_handle* hck, struct hck_client* c, uint32_t index, uint16_t result){
+	struct hck_bulk* b = c->bulk;
+	struct hck_frame f;
+	size_t len = b->results.size() * sizeof(b->results[0]);
+
+	b->results[index] = result;
+	if (--b->pending != 0){
+		return;
+	}
+
+	f.version = HCK_PROTOCOL_VERSION;
+	f.type = HCK_MSG_RESULTS;
+	f.length = len;
+	f.id = b->id;
+	client_write(hck, b->client, &f, sizeof(f));
+	client_write(hck, b->client, &b->results[0], len);
+	client_release(b->client);
+
+	/* Gone once the checks still holding it let go */
+	delete b;
+	c->bulk = NULL;
+	c->closed = true;
+	if (c->refs == 0){
+		delete c;
+	}
+}
+
+static void race_result(hck_handle* hck, struct hck_client* c, uint32_t index, uint16_t result);
+
+//send result from worker -> process
+static void send_result(hck_handle* hck, struct hck_client* c, uint32_t id, uint16_t result){
+	struct {
+		struct hck_frame f;
+		uint16_t result;
+	} __attribute__((packed)) msg;
+
+	if (c->bulk != NULL){
+		bulk_result(hck, c, id, result);
+		return;
+	}
+	if (c->race != NULL){
+		race_result(hck, c, id, result);
+		return;
+	}
+
+	msg.f.version = HCK_PROTOCOL_VERSION;
+	msg.f.type = HCK_MSG_RESULT;
+	msg.f.length = sizeof(msg.result);
+	msg.f.id = id;
+	msg.result = result;
+
+	client_write(hck, c, &msg, sizeof(msg));
+}
+
+static bool waiter_add(hck_handle* hck, struct hck_waiter** list, struct hck_client* c, uint32_t id){
+	struct hck_waiter* w = hck->waiter_slab.alloc();
+
+	if (w == NULL){
+		return false;
+	}
+
+	w->client = c;
+	w->spec = NULL;
+	w->id = id;
+	w->next = *list;
+	*list = w;
+	c->refs++;
+	return true;
+}
+
+// answer every request on a list, skipping clients that have gone away
+static void waiters_answer(hck_handle* hck, struct hck_waiter* w, uint16_t result){
+	struct hck_waiter* next;
+
+	for (; w != NULL; w = next){
+		next = w->next;
+		send_result(hck, w->client, w->id, result);
+		client_release(w->client);
+		hck->waiter_slab.release(w);
+	}
+}
+
+static bool check_attach(hck_handle* hck, struct hck_details* h, struct hck_client* c, uint32_t id){
+	return waiter_add(hck, &h->waiters, c, id);
+}
+
+// answer the clients waiting on a check, if there still are any
+static void check_answer(hck_handle* hck, struct hck_details* h, uint16_t result){
+	if (h->target->inflight == h){
+		h->target->inflight = NULL;
+	}
+
+	waiters_answer(hck, h->waiters, result);
+	h->waiters = NULL;
+}
+
+// remember a definitive result for the result cache
+static void result_store(struct hck_target* t, uint16_t result, uint64_t now){
+	t->last_result = result;
+	t->last_result_at = now;
+}
+
+// take the requests queued on a connection, as one list
+static struct hck_waiter* pipeline_take(struct hck_details* h){
+	struct hck_waiter* queued = h->queued;
+
+	h->queued = NULL;
+	h->pipelined = 0;
+	return queued;
+}
+
+static void check_free(hck_handle* hck, struct hck_details* h){
+	assert(h->queued == NULL);
+	h->generation++;
+#ifdef HCK_IO_URING
+	/* The ring still refers to the check, the last completion frees it */
+	if (h->pending != 0){
+		h->released = true;
+		return;
+	}
+	if (h->rbuf != NULL){
+		hck->rbufs.release(h->rbuf);
+		h->rbuf = NULL;
+	}
+#endif
+	hck->slab.release(h);
+}
+
+static bool io_exchange(hck_handle* hck, struct hck_details* h);
+static void io_idle(hck_handle* hck, struct hck_details* h);
+static bool io_connect(hck_handle* hck, struct hck_details* h, bool fastopen);
+static bool io_pipeline(hck_handle* hck, struct hck_details* h);
+
+static void http_cleanup(hck_handle& hck, struct hck_details* h);
+static void http_broken(hck_handle& hck, struct hck_details* h, uint64_t now);
+static bool tfo_reconnect(hck_handle& hck, struct hck_details* h, uint64_t now);
+
+static hck_details* keepalive_lookup(hck_handle* hck, struct hck_target* t, uint64_t now) {
+	while (!t->idle.empty()) {
+		struct hck_details* h = t->idle.back();
+
+		assert(h->target == t);
+		assert(h->state == hck_details::keepalive);
+		assert(h->pipelined == 0);
+
+		//Remove from the pool
+		t->idle.pop_back();
+
+		h->state = hck_details::recovery;
+		h->position = 0;
+		set_expiry(hck, h, now + timeout_for(t, false));
+		h->waiters = NULL;
+		h->first = false;
+		h->tfo = true;
+		memset(&h->resp, 0, sizeof(h->resp));
+		timing_start(hck, h);
+
+		if (io_exchange(hck, h)){
+			return h;
+		}
+
+		/* Closed by the server while idle, try the next one */
+		counters.keepalive_stale++;
+		http_cleanup(*hck, h);
+	}
+
+	return NULL;
+}
+
+static int create_new_socket(const struct hck_target* t, bool fastopen = true, int* sent = NULL) {
+	int socket_desc;
+	int rc;
+	const struct sockaddr* sockaddr = (const struct sockaddr*)&t->sockaddr;
+	socklen_t sockaddr_len = t->sockaddr_len;
+
+	//Create socket
+	socket_desc = socket(t->addr.family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	counters.socket++;
+	if (socket_desc == -1)
+	{
+		return -1;
+	}
+
+	//Connect to remote server
+	counters.connect++;
+#ifdef MSG_FASTOPEN
+	if (fastopen)
+	{
+		rc = sendto(socket_desc, t->spec->request.data(), t->spec->request.size(), MSG_FASTOPEN, sockaddr, sockaddr_len);
+	}
+	else
+	{
+		rc = connect(socket_desc, sockaddr, sockaddr_len);
+	}
+#else
+	rc = connect(socket_desc, sockaddr, sockaddr_len);
+#endif
+	if (sent != NULL){
+		*sent = rc;
+	}
+	if (rc != -1){
+		return socket_desc;
+	}
+	else
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
+			return socket_desc;
+		}
+		close(socket_desc);
+		return rc;
+	}
+}
+
+// make room for a new check socket within the budget, closing the least recently used idle connections. False if none are left to close
+static bool fd_reserve(hck_handle* hck){
+	struct hck_details* h;
+
+	while (hck->sockets.size() >= hck->fd_budget){
+		h = hck->idle_lru.pop(UINT64_MAX);
+		if (h == NULL){
+			return false;
+		}
+		if (h->state != hck_details::keepalive){
+			continue;
+		}
+		counters.evicted++;
+		http_cleanup(*hck, h);
+	}
+	return true;
+}
+
+static struct hck_details* create_new_hck(hck_handle* hck, struct hck_target* t, uint64_t now, bool fastopen = true) {
+	struct hck_details* h;
+	uint64_t start = monotonic_ns();
+
+	if (!fd_reserve(hck)){
+		zabbix_log(LOG_LEVEL_DEBUG, "HCK: %zu check sockets open, no room for another", hck->sockets.size());
+		return NULL;
+	}
+
+	h = hck->slab.alloc();
+	if (h == NULL)
+	{
+		zabbix_log(LOG_LEVEL_WARNING, "Unable to allocate check");
+		return NULL;
+	}
+
+	h->waiters = NULL;
+	h->queued = NULL;
+	h->pipelined = 0;
+	h->target = t;
+	h->first = true;
+	h->position = 0;
+	memset(&h->resp, 0, sizeof(h->resp));
+
+	/* Targets that did not take TCP Fast Open are connected to without it, but for the odd retry */
+	if (fastopen && !tfo_wanted(t, now)){
+		fastopen = false;
+		counters.tfo_skipped++;
+	}
+	h->tfo = fastopen;
+
+	if (!io_connect(hck, h, fastopen)){
+		check_free(hck, h);
+		return NULL;
+	}
+	timing_start(hck, h, start);
+	if (h->position > 0){
+		/* Sent along with the SYN, the handshake is not seen */
+		timing_mark(hck, h, PHASE_WRITE);
+	}
+
+	set_expiry(hck, h, now + timeout_for(t, true));
+	t->connections++;
+
+	return h;
+}
+
+static void http_cleanup(hck_handle& hck, struct hck_details* h){
+	int erased;
+
+	if (h->state == hck_details::keepalive){
+		//Take it out of the pool
+		pool_remove(h->target, h);
+	}
+
+	//Cleanup remote
+	h->target->connections--;
+	if (h->remote_socket != -1){
+		erased = hck.sockets.erase(h->remote_socket);
+		assert(erased == 1);
+#ifdef HCK_IO_URING
+		/* Queued operations name the socket by number, hand them over before it is reused */
+		if (hck.backend == BACKEND_URING && hck.ring.queued() != 0){
+			hck.ring.submit();
+		}
+#endif
+		/* Also completes anything the ring still has in flight on the socket */
+		shutdown(h->remote_socket, SHUT_RDWR);
+		close(h->remote_socket);
+		counters.close++;
+	}
+
+
+	//Nobody should be left waiting
+	check_answer(&hck, h, HCK_RESULT_FAIL);
+	waiters_answer(&hck, pipeline_take(h), HCK_RESULT_FAIL);
+
+	//Finally return the check to the pool
+	check_free(&hck, h);
+}
+
+// start a check on a pooled or new connection
+static struct hck_details* check_start(hck_handle* hck, struct hck_target* t, uint64_t now, bool tfo = true){
+	struct hck_details* h;
+
+	h = keepalive_lookup(hck, t, now);
+
+	if (h == NULL) {
+		counters.keepalive_misses++;
+		h = create_new_hck(hck, t, now, tfo);
+
+		if (h != NULL) {
+			//Assert that socket entries are cleaned up when sockets are closed
+			assert(hck->sockets.find(h->remote_socket) == NULL);
+			hck->sockets.insert(h->remote_socket, h);
+		}
+	}
+	else
+	{
+		counters.keepalive_hits++;
+		assert(hck->sockets.find(h->remote_socket) == h);
+	}
+
+	if (h != NULL){
+		t->inflight = h;
+
+		/* No use going on once the poller has given up */
+		if (hck->deadline != 0 && hck->deadline < h->expires){
+			set_expiry(hck, h, hck->deadline);
+		}
+	}
+	return h;
+}
+
+// start checks again on a new connection, their request was lost with the old one
+static void check_restart(hck_handle* hck, struct hck_target* t, struct hck_waiter* waiters, uint64_t now){
+	struct hck_details* h = create_new_hck(hck, t, now);
+
+	counters.retries++;
+	if (h != NULL){
+		hck->sockets.insert(h->remote_socket, h);
+		h->waiters = waiters;
+		t->inflight = h;
+	}
+	else{
+		waiters_answer(hck, waiters, HCK_RESULT_FAIL);
+	}
+}
+
+// send a request behind the one in flight on a keepalive connection, false if the connection can not take it
+static bool pipeline_add(hck_handle* hck, struct hck_details* h, struct hck_client* c, uint32_t id, uint64_t now){
+	struct hck_waiter* w = NULL;
+	struct hck_waiter** tail;
+	size_t size = h->target->spec->request.size();
+
+	/* Only to a server that keeps connections open, on a connection it is not closing */
+	if (!h->target->persistent || h->state == hck_details::keepalive || h->resp.close ||
+		h->pipelined + 1 >= config.pipeline || size * (h->pipelined + 2) >= 1 << 14){
+		return false;
+	}
+	if (!waiter_add(hck, &w, c, id)){
+		return false;
+	}
+
+	for (tail = &h->queued; *tail != NULL; tail = &(*tail)->next);
+	*tail = w;
+	h->pipelined++;
+	counters.pipelined++;
+
+	if (!io_pipeline(hck, h)){
+		http_broken(*hck, h, now);
+	}
+	return true;
+}
+
+// xorshift, the jitter only has to differ between targets and workers
+static uint32_t schedule_random(hck_handle* hck){
+	hck->seed ^= hck->seed << 13;
+	hck->seed ^= hck->seed >> 17;
+	hck->seed ^= hck->seed << 5;
+	return hck->seed;
+}
+
+// plan the next run of a scheduled target, after delay ms give or take a tenth of its interval
+static void schedule_run(hck_handle* hck, struct hck_target* t, uint64_t delay, uint64_t now){
+	t->next_run = now + delay - t->interval / 10 + schedule_random(hck) % (t->interval / 5 + 1);
+	hck->schedule.add(target_key(t), t->next_run);
+}
+
+/*
+Learn how often the pollers ask for a target, from the gaps between their
+requests or the interval a request registers. With Schedule, or once an
+interval is registered, the worker checks the target on its own at that
+interval and the requests are answered from the latest result. The first run
+goes somewhere in the middle of the interval, so that targets polled together
+are not all checked together.
+*/
+static void schedule_learn(hck_handle* hck, struct hck_target* t, uint64_t now){
+	uint64_t gap = t->last_request != 0 ? now - t->last_request : 0;
+	uint32_t interval = t->interval;
+
+	t->last_request = now;
+	if (hck->interval != 0){
+		interval = max(hck->interval, (uint32_t)SCHEDULE_MIN);
+	}
+	else if (!config.schedule || gap < SCHEDULE_MIN || gap > UINT32_MAX){
+		return;
+	}
+	else{
+		/* Smoothed, a poller skipping a beat should not halve it */
+		interval = interval == 0 ? gap : (3 * (uint64_t)interval + gap) / 4;
+	}
+
+	if (t->next_run == 0){
+		t->interval = interval;
+		schedule_run(hck, t, interval / 2, now);
+	}
+	t->interval = interval;
+}
+
+// start the scheduled checks that are due
+void handle_schedule(hck_handle& hck, uint64_t now){
+	struct hck_target_key key;
+	uint64_t due;
+
+	while (hck.schedule.pop(now, &key, &due)){
+		unordered_map<struct hck_target_key, struct hck_target*, struct hck_target_key_hash>::iterator it = hck.targets.find(key);
+		if (it == hck.targets.end() || it->second->next_run != due){
+			continue;
+		}
+
+		struct hck_target* t = it->second;
+
+		/* The pollers stopped asking */
+		if (t->last_request + (uint64_t)SCHEDULE_IDLE * t->interval < now){
+			t->interval = 0;
+			t->next_run = 0;
+			continue;
+		}
+		schedule_run(&hck, t, t->interval, now);
+
+		/* A check already waiting on the target gives the result */
+		if (t->inflight != NULL){
+			continue;
+		}
+
+		/* No socket to spare, the run is skipped rather than kept as a failure of the target */
+		if (t->idle.empty() && !fd_reserve(&hck)){
+			counters.overloaded++;
+			continue;
+		}
+		counters.scheduled++;
+		if (check_start(&hck, t, now) == NULL){
+			result_store(t, HCK_RESULT_FAIL, now);
+		}
+	}
+}
+
+// add a check in the worker
+bool check_add(hck_handle* hck, const struct hck_addr& addr, struct hck_spec* spec, uint64_t now, struct hck_client* c, uint32_t id, bool tfo = true){
+	struct hck_details* h;
+	struct hck_target* t = target_get(hck, addr, spec, now);
+
+	schedule_learn(hck, t, now);
+
+	/* A scheduled target answers from its latest result, unless it is older than two runs */
+	if (t->interval != 0 && t->last_result_at != 0 && t->last_result_at + 2 * (uint64_t)t->interval > now){
+		counters.cached++;
+		send_result(hck, c, id, t->last_result);
+		return true;
+	}
+
+	/* A recent enough result answers straight away */
+	if (config.result_cache > 0 && t->last_result_at != 0 && t->last_result_at + config.result_cache > now){
+		counters.cached++;
+		send_result(hck, c, id, t->last_result);
+		return true;
+	}
+
+	/* Join a check that is already waiting on the target */
+	if (config.coalesce && t->inflight != NULL){
+		counters.coalesced++;
+		return check_attach(hck, t->inflight, c, id);
+	}
+
+	/* Or, with no pooled connection free, send the request behind it */
+	if (t->inflight != NULL && t->idle.empty() && pipeline_add(hck, t->inflight, c, id, now)){
+		return true;
+	}
+
+	/* A new connection is needed and there is no room for it, say so rather than fail the target */
+	if (t->idle.empty() && !fd_reserve(hck)){
+		counters.overloaded++;
+		send_result(hck, c, id, HCK_RESULT_OVERLOADED);
+		return true;
+	}
+
+	h = check_start(hck, t, now, tfo);
+	if (h == NULL){
+		return false;
+	}
+
+	if (!check_attach(hck, h, c, id)){
+		http_cleanup(*hck, h);
+		return false;
+	}
+	return true;
+}
+
+// feed response bytes to a check, the response is complete once any body is skipped as well, taking consumed bytes
+static int http_parse(hck_handle* hck, struct hck_details* h, const char* respbuff, int rc, int* consumed){
+	struct hck_resp* r = &h->resp;
+	size_t used = 0;
+
+	*consumed = 0;
+	if (r->state != RESP_DONE){
+		int result = resp_parse(r, respbuff, rc, &used);
+		if (result == HTTP_INVALID){
+			zabbix_log(LOG_LEVEL_WARNING, "HCK: invalid response from socket %d", h->remote_socket);
+		}
+		if (result != HTTP_OK){
+			return result;
+		}
+		timing_mark(hck, h, PHASE_HEADER);
+
+		/* Responses to HEAD, 1xx, 204 and 304 have no body */
+		if (h->target->spec->head || r->status < 200 || r->status == 204 || r->status == 304){
+			r->length = 0;
+		}
+		else if (!r->has_length){
+			/* Chunked or ended by the server closing, answer now and do not reuse */
+			r->close = true;
+			r->length = 0;
+		}
+		rc -= used;
+	}
+
+	/* length counts down the body still to come */
+	if ((size_t)rc < r->length){
+		r->length -= rc;
+		return HTTP_MORE;
+	}
+	*consumed = used + r->length;
+	r->length = 0;
+	return HTTP_OK;
+}
+
+// the response is complete, answer by its status and keep the connection for the next check if the server allows.
+// True if the connection goes on to the response to a pipelined request
+static bool http_done(hck_handle& hck, struct hck_details* h, uint64_t now, bool closing = false){
+	uint16_t result = h->resp.status < 500 ? HCK_RESULT_OK : HCK_RESULT_FAIL;
+	size_t size = h->target->spec->request.size();
+	bool reusable = !closing && resp_reusable(&h->resp) && h->position >= size;
+
+	if (result != HCK_RESULT_OK){
+		zabbix_log(LOG_LEVEL_DEBUG, "HCK: status %d from socket %d", h->resp.status, h->remote_socket);
+	}
+
+	counters.checks++;
+	latency_record(&hck, h, now);
+	tfo_learn(&hck, h, now);
+	h->target->last_status = h->resp.status;
+	h->target->persistent = reusable;
+	result_store(h->target, result, now);
+	check_answer(&hck, h, result);
+
+	if (h->pipelined > 0){
+		if (!reusable){
+			/* The server is done with the connection, what was queued goes again on a new one */
+			struct hck_target* t = h->target;
+			struct hck_waiter* queued = pipeline_take(h);
+			http_cleanup(hck, h);
+			check_restart(&hck, t, queued, now);
+			return false;
+		}
+
+		/* The next request becomes the current one */
+		h->waiters = h->queued;
+		h->queued = h->waiters->next;
+		h->waiters->next = NULL;
+		h->pipelined--;
+		h->position -= size;
+		h->first = false;	// retried like a pooled connection if it breaks now
+		timing_start(&hck, h);
+		h->state = h->position >= size ? hck_details::reading : hck_details::writing;
+		memset(&h->resp, 0, sizeof(h->resp));
+		set_expiry(&hck, h, now + timeout_for(h->target, false));
+		if (h->target->inflight == NULL){
+			h->target->inflight = h;
+		}
+		return true;
+	}
+
+	h->position = 0;
+
+	if (!reusable){
+		http_cleanup(hck, h);
+	}
+	/* If the pool is already full, don't re-add */
+	else if (h->target->idle.size() >= (size_t)config.keepalive_max) {
+		zabbix_log(LOG_LEVEL_DEBUG, "Extra connection was opened, no longer needed - the keepalive pool is full.");
+		http_cleanup(hck, h);
+	}
+	else 
+	{
+		h->state = hck_details::keepalive;
+		h->target->idle.push_back(h);
+		pool_expiry(&hck, h, now + config.timeout_post);
+		io_idle(&hck, h);
+	}
+	return false;
+}
+
+static void http_fail(hck_handle& hck, struct hck_details* h, uint64_t now){
+	/* A scheduled check has nobody waiting, but is the latest on its target */
+	if (h->waiters != NULL || h->target->inflight == h){
+		counters.checks++;
+		result_store(h->target, HCK_RESULT_FAIL, now);
+	}
+	check_answer(&hck, h, HCK_RESULT_FAIL);
+	http_cleanup(hck, h);
+}
+
+// feed received bytes to a check, one read may end a response and start the next pipelined one.
+// False once the connection is done reading, closing if the server closed it after these bytes
+static bool http_input(hck_handle& hck, struct hck_details* h, const char* buf, int len, uint64_t now, bool closing = false){
+	int used;
+
+	for (;;){
+		timing_mark(&hck, h, PHASE_READ);
+		switch (http_parse(&hck, h, buf, len, &used)){
+		case HTTP_MORE:
+			return true;
+		case HTTP_INVALID:
+			http_fail(hck, h, now);
+			return false;
+		}
+
+		buf += used;
+		len -= used;
+		if (len > 0 && h->pipelined == 0){
+			/* More than the response, the connection is out of step */
+			h->resp.close = true;
+		}
+		if (!http_done(hck, h, now, closing && len == 0)){
+			return false;
+		}
+		if (len == 0){
+			return true;
+		}
+	}
+}
+
+/* Retry once on a fresh connection, without another round trip to the poller, along with any pipelined requests */
+static void http_retry(hck_handle& hck, struct hck_details* h, uint64_t now){
+	struct hck_waiter* waiters = h->waiters;
+	struct hck_waiter** tail = &waiters;
+	struct hck_target* t = h->target;
+	bool scheduled = t->inflight == h;	// a scheduled check is retried for its result alone
+
+	h->waiters = NULL;
+	while (*tail != NULL){
+		tail = &(*tail)->next;
+	}
+	*tail = pipeline_take(h);
+	http_cleanup(hck, h);
+
+	if (waiters != NULL || scheduled){
+		check_restart(&hck, t, waiters, now);
+	}
+}
+
+// the connection failed or was closed under a check
+static void http_broken(hck_handle& hck, struct hck_details* h, uint64_t now){
+	struct hck_target* t = h->target;
+	struct hck_waiter* queued;
+
+	if (h->state == hck_details::keepalive){
+		zabbix_log(LOG_LEVEL_DEBUG, "Keepalive connection closing, no longer open");
+		http_cleanup(hck, h);
+		return;
+	}
+
+	/* A connection opened with TCP Fast Open that broke before any answer is tried once more without it */
+	if (h->first && h->tfo && h->pipelined == 0 && h->resp.state == RESP_VERSION && h->resp.match == 0 && tfo_reconnect(hck, h, now)){
+		return;
+	}
+
+	/* A pooled connection that went stale before anything was read, or one reset for the requests pipelined on it */
+	if ((!h->first || h->pipelined > 0) && (h->state == hck_details::recovery || h->state == hck_details::writing || (h->state == hck_details::reading && h->resp.state == RESP_VERSION && h->resp.match == 0))){
+		http_retry(hck, h, now);
+		return;
+	}
+
+	/* Pipelined requests had no response yet, they are retried even when the current one fails */
+	queued = pipeline_take(h);
+	http_fail(hck, h, now);
+	if (queued != NULL){
+		check_restart(&hck, t, queued, now);
+	}
+}
+
+/* Level triggered sockets are re-armed for the next state, edge triggered ones are registered once for everything */
+#define EPOLL_EDGE (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+static void epoll_mod(hck_handle* hck, int fd, uint32_t events){
+	struct epoll_event e;
+
+	e.events = events;
+	e.data.fd = fd;
+	counters.epoll_ctl++;
+	if (epoll_ctl(hck->epfd, EPOLL_CTL_MOD, fd, &e) < 0)
+	{
+		zabbix_log(LOG_LEVEL_WARNING, "Unable to mod epoll: %s", strerror(errno));
+	}
+}
+
+static bool epoll_connect(hck_handle* hck, struct hck_details* h, bool fastopen){
+	struct epoll_event e;
+	int rc, sent;
+
+	h->remote_socket = create_new_socket(h->target, fastopen, &sent);
+	if (h->remote_socket == -1)
+	{
+		zabbix_log(LOG_LEVEL_WARNING, "Unable to create new socket: %s", strerror(errno));
+		return false;
+	}
+
+	if (sent == -1) 
+	{
+#ifdef MSG_FASTOPEN
+		e.events = EPOLLOUT;
+		h->state = hck_details::writing;
+		h->position = 0;
+#else
+		e.events = EPOLLIN | EPOLLOUT;
+		h->state = hck_details::connecting;
+#endif
+	}else{
+#ifdef MSG_FASTOPEN
+		if ((size_t)sent < h->target->spec->request.size()) 
+		{
+			e.events = EPOLLOUT;
+			h->state = hck_details::writing;
+			h->position = sent;
+		}
+		else 
+		{
+			e.events = EPOLLIN;
+			h->state = hck_details::reading;
+			h->position = sent;
+		}
+#else
+		e.events = EPOLLOUT;
+		h->state = hck_details::writing;
+		h->position = 0;
+#endif
+	}
+	if (hck->edge){
+		e.events = EPOLL_EDGE;
+	}
+	e.data.fd = h->remote_socket;
+	counters.epoll_ctl++;
+	rc = epoll_ctl(hck->epfd, EPOLL_CTL_ADD, h->remote_socket, &e);
+	if (rc < 0)
+	{
+		zabbix_log(LOG_LEVEL_WARNING, "Unable to add socket to epoll: %s", strerror(errno));
+		close(h->remote_socket);
+		h->remote_socket = -1;
+		return false;
+	}
+
+	return true;
+}
+
+// connect again without TCP Fast Open, remembering the target does not take it. False if the connection failed
+static bool tfo_reconnect(hck_handle& hck, struct hck_details* h, uint64_t now){
+	struct hck_timing tm = hck.timings[h->remote_socket];
+	int erased;
+
+	tfo_give_up(h->target, now);
+	counters.tfo_fallbacks++;
+
+	erased = hck.sockets.erase(h->remote_socket);
+	assert(erased == 1);
+	close(h->remote_socket);
+	counters.close++;
+
+	h->tfo = false;
+	if (!epoll_connect(&hck, h, false)){
+		h->remote_socket = -1;
+		return false;
+	}
+	hck.sockets.insert(h->remote_socket, h);
+	*timing_of(&hck, h->remote_socket) = tm;
+	return true;
+}
+
+// send what is left of the request and any pipelined behind it: 1 once it is all sent, 0 if the socket is full, -1 on error
+static int http_send(hck_handle* hck, struct hck_details* h){
+	const string& request = h->target->spec->request;
+	size_t total = request.size() * (h->pipelined + 1);
+	bool unsent = h->state == hck_details::reading;	// level triggered, EPOLLOUT is wanted while reading
+	int rc = 0;
+
+	/* Every request on a connection is the same, position runs across them */
+	while (h->position < total){
+		size_t offset = h->position % request.size();
+
+		rc = send(h->remote_socket, request.data() + offset, request.size() - offset, MSG_NOSIGNAL);
+		counters.send++;
+		if (rc == -1){
 			if (errno == EAGAIN || errno == EWOULDBLOCK){
+				break;
+			}
+			zabbix_log(LOG_LEVEL_DEBUG, "HCK: failed to send data (%s)", strerror(errno));
+			return -1;
+		}
+		if (h->position < request.size()){
+			/* Writable, so connected if it is new, and the current request is going out */
+			if (h->first){
+				timing_mark(hck, h, PHASE_CONNECT);
+			}
+			timing_mark(hck, h, PHASE_WRITE);
+		}
+		h->position += rc;
+	}
+
+	if (h->state == hck_details::writing && h->position >= request.size()){
+		h->state = hck_details::reading;
+		if (!hck->edge){
+			epoll_mod(hck, h->remote_socket, h->position < total ? EPOLLIN | EPOLLOUT : EPOLLIN);
+		}
+	}
+	else if (!hck->edge && unsent && h->position >= total){
+		epoll_mod(hck, h->remote_socket, EPOLLIN);
+	}
+	return h->position >= total ? 1 : 0;
+}
+
+// handle a http event
+void handle_http(hck_handle& hck, struct hck_details* h, struct epoll_event e, uint64_t now){
+	int rc;
+	char respbuff[READSIZE];
+
+	if (h->state == hck_details::connecting){
+		if (e.events & EPOLLIN || e.events & EPOLLOUT){
+			/* Connection success */
+			if (!hck.edge){
+				epoll_mod(&hck, e.data.fd, EPOLLOUT);
+			}
+			h->state = hck_details::writing;
+			timing_mark(&hck, h, PHASE_CONNECT);
+		}
+	}
+
+
+	/* Do not pass go, do not collect $200 */
+	/* An error has occured on the socket, time to cleanup */
+	if (e.events & EPOLLERR){
+		if (h->state != hck_details::keepalive){
+			recv(e.data.fd, 0, 0, 0);
+			counters.recv++;
+			zabbix_log(LOG_LEVEL_WARNING, "Sending failure due to error: %s", strerror(errno));
+		}
+		http_broken(hck, h, now);
+		return;
+	}
+
+	if (h->state == hck_details::recovery){
+		if (e.events & EPOLLHUP || e.events & EPOLLRDHUP){
+			zabbix_log(LOG_LEVEL_DEBUG, "Keepalive recovery connection closing, no longer open");
+			http_broken(hck, h, now);
+			return;
+		}
+
+		// Place back into wiritng
+		h->state = hck_details::writing;
+		assert(h->position == 0);
+	}
+
+	if (h->state == hck_details::writing){
+		if (http_send(&hck, h) == -1){
+			http_broken(hck, h, now);
+			return;
+		}
+	}
+	else if (h->state == hck_details::reading){
+		/* Pipelined requests that did not fit in the send buffer */
+		if ((e.events & EPOLLOUT) && h->pipelined > 0 && http_send(&hck, h) == -1){
+			http_broken(hck, h, now);
+			return;
+		}
+
+		/* Edge triggered sockets also report the send buffer draining */
+		if (!(e.events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP))){
+			return;
+		}
+
+		/* Read until a short read, an edge is not reported again for data already there */
+		do{
+			rc = recv(e.data.fd, respbuff, sizeof(respbuff), 0);
+			counters.recv++;
+
+			if (rc == -1){
+				if (errno == EAGAIN || errno == EWOULDBLOCK){
+					return;
+				}
+				zabbix_log(LOG_LEVEL_WARNING, "HCK: failed to recv data (%s)\n", strerror(errno));
+			}
+			if (rc <= 0){
+				http_broken(hck, h, now);
 				return;
 			}
-			zabbix_log(LOG_LEVEL_WARNING, "HCK: failed to recv data (%s)\n", strerror(errno));
-			if (!h->first && h->position == 0){
-				goto send_retry;
+
+			/* A server that closes after the last response leaves nothing to keep */
+			if (!http_input(hck, h, respbuff, rc, now, rc < (int)sizeof(respbuff) && (e.events & (EPOLLHUP | EPOLLRDHUP)) != 0)){
+				return;
+			}
+		} while (rc == sizeof(respbuff));
+
+		/* Closed before the response the connection is waiting on */
+		if (e.events & (EPOLLHUP | EPOLLRDHUP)){
+			http_broken(hck, h, now);
+		}
+		return;
+	}
+	else if (h->state == hck_details::keepalive){
+		rc = recv(e.data.fd, respbuff, sizeof(respbuff), 0);
+		counters.recv++;
+		if (rc == 0 || (rc == -1 && errno != EAGAIN && errno != EWOULDBLOCK)){
+			http_broken(hck, h, now);
+			return;
+		}
+	}
+
+	if (!(e.events & EPOLLOUT) && !(e.events & EPOLLIN) && (e.events & EPOLLHUP || e.events & EPOLLRDHUP)){
+		zabbix_log(LOG_LEVEL_DEBUG, "HCK: connection interrupted\n");
+		http_broken(hck, h, now);
+	}
+}
+
+#ifdef HCK_IO_URING
+static struct io_uring_sqe* uring_sqe(hck_handle* hck, struct hck_details* h, int op){
+	struct io_uring_sqe* sqe = hck->ring.sqe();
+
+	sqe->user_data = (uint64_t)(uintptr_t)h | op;
+	h->pending++;
+	return sqe;
+}
+
+static void uring_send(hck_handle* hck, struct hck_details* h, unsigned flags){
+	struct io_uring_sqe* sqe = uring_sqe(hck, h, URING_SEND);
+
+	const string& request = h->target->spec->request;
+	size_t offset = h->position % request.size();
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = h->remote_socket;
+	sqe->addr = (uint64_t)(uintptr_t)(request.data() + offset);
+	sqe->len = request.size() - offset;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->flags = flags;
+}
+
+static bool uring_recv(hck_handle* hck, struct hck_details* h){
+	struct io_uring_sqe* sqe;
+
+	if (h->rbuf == NULL){
+		h->rbuf = hck->rbufs.alloc();
+		if (h->rbuf == NULL){
+			return false;
+		}
+	}
+
+	sqe = uring_sqe(hck, h, URING_RECV);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = h->remote_socket;
+	sqe->addr = (uint64_t)(uintptr_t)h->rbuf->data;
+	sqe->len = sizeof(h->rbuf->data);
+	return true;
+}
+
+// connect, send and receive as one linked submission
+static bool uring_connect(hck_handle* hck, struct hck_details* h){
+	struct io_uring_sqe* sqe;
+
+	h->remote_socket = socket(h->target->addr.family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	counters.socket++;
+	if (h->remote_socket == -1){
+		zabbix_log(LOG_LEVEL_WARNING, "Unable to create new socket: %s", strerror(errno));
+		return false;
+	}
+
+	h->state = hck_details::connecting;
+	h->tfo = false;
+
+	sqe = uring_sqe(hck, h, URING_CONNECT);
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = h->remote_socket;
+	sqe->addr = (uint64_t)(uintptr_t)&h->target->sockaddr;
+	sqe->off = h->target->sockaddr_len;
+	sqe->flags = IOSQE_IO_LINK;
+
+	uring_send(hck, h, IOSQE_IO_LINK);
+	if (!uring_recv(hck, h)){
+		/* the linked send fails with the connect once the socket is closed */
+		zabbix_log(LOG_LEVEL_WARNING, "Unable to allocate receive buffer");
+	}
+	return true;
+}
+
+// handle a completion for a check
+static void handle_uring(hck_handle& hck, uint64_t user_data, int res, uint64_t now){
+	struct hck_details* h = (struct hck_details*)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+	int op = user_data & URING_OP_MASK;
+
+	h->pending--;
+	if (op == URING_POLL){
+		h->polling = false;
+	}
+
+	/* Completions that outlived their check */
+	if (h->released){
+		if (h->pending == 0){
+			h->released = false;
+			check_free(&hck, h);
+		}
+		return;
+	}
+
+	/* Whatever broke the chain has already been handled */
+	if (res == -ECANCELED){
+		return;
+	}
+
+	switch (op){
+	case URING_CONNECT:
+		if (res < 0){
+			zabbix_log(LOG_LEVEL_DEBUG, "HCK: connect failed (%s)", strerror(-res));
+			http_broken(hck, h, now);
+			return;
+		}
+		h->state = hck_details::writing;
+		timing_mark(&hck, h, PHASE_CONNECT);
+		break;
+	case URING_SEND:
+		if (res < 0){
+			zabbix_log(LOG_LEVEL_WARNING, "HCK: failed to send data (%s)", strerror(-res));
+			http_broken(hck, h, now);
+			return;
+		}
+		if (h->position < h->target->spec->request.size()){
+			timing_mark(&hck, h, PHASE_WRITE);
+		}
+		h->position += res;
+		if (h->state == hck_details::writing && h->position >= h->target->spec->request.size()){
+			h->state = hck_details::reading;
+		}
+		/* One send at a time, the receive is already waiting for the response */
+		if (h->position < h->target->spec->request.size() * (h->pipelined + 1)){
+			uring_send(&hck, h, 0);
+		}
+		break;
+	case URING_RECV:
+		if (res <= 0){
+			if (res < 0){
+				zabbix_log(LOG_LEVEL_WARNING, "HCK: failed to recv data (%s)", strerror(-res));
+			}
+			http_broken(hck, h, now);
+			return;
+		}
+
+		if (!http_input(hck, h, h->rbuf->data, res, now)){
+			return;
+		}
+
+		if (!uring_recv(&hck, h)){
+			http_fail(hck, h, now);
+		}
+		break;
+	case URING_POLL:
+		if (h->state != hck_details::keepalive){
+			/* Woken by the response to a check, the poll is re-armed when it is idle again */
+			break;
+		}
+
+		/* An idle connection became readable, it is closed or sent junk unless the wakeup was for the last response */
+		if (!(res & (POLLHUP | POLLRDHUP | POLLERR))){
+			char c;
+			int rc = recv(h->remote_socket, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+			counters.recv++;
+			if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+				io_idle(&hck, h);
+				break;
+			}
+		}
+		http_broken(hck, h, now);
+		break;
+	}
+}
+#endif
+
+// send the request on a pooled connection, false if it turns out to be closed
+static bool io_exchange(hck_handle* hck, struct hck_details* h){
+#ifdef HCK_IO_URING
+	if (hck->backend == BACKEND_URING){
+		h->state = hck_details::writing;
+		uring_send(hck, h, IOSQE_IO_LINK);
+		if (!uring_recv(hck, h)){
+			zabbix_log(LOG_LEVEL_WARNING, "Unable to allocate receive buffer");
+		}
+		return true;
+	}
+#endif
+	if (hck->edge){
+		/* The socket is writable already and will not report it again, send now */
+		h->state = hck_details::writing;
+		return http_send(hck, h) != -1;
+	}
+	epoll_mod(hck, h->remote_socket, EPOLLOUT);
+	return true;
+}
+
+// watch an idle keepalive connection for the server closing it
+static void io_idle(hck_handle* hck, struct hck_details* h){
+#ifdef HCK_IO_URING
+	if (hck->backend == BACKEND_URING){
+		/* Nothing is received while idle */
+		if (h->rbuf != NULL){
+			hck->rbufs.release(h->rbuf);
+			h->rbuf = NULL;
+		}
+		if (!h->polling){
+			struct io_uring_sqe* sqe = uring_sqe(hck, h, URING_POLL);
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->fd = h->remote_socket;
+			sqe->poll32_events = POLLIN | POLLRDHUP;
+			h->polling = true;
+		}
+		return;
+	}
+#endif
+	//Only get read events for keepalive
+	if (!hck->edge){
+		epoll_mod(hck, h->remote_socket, EPOLLIN);
+	}
+}
+
+// send a request just queued behind others, false if the connection turns out to be broken
+static bool io_pipeline(hck_handle* hck, struct hck_details* h){
+	/* Requests still going out take it along */
+	if (h->position < h->target->spec->request.size() * h->pipelined){
+		return true;
+	}
+#ifdef HCK_IO_URING
+	if (hck->backend == BACKEND_URING){
+		uring_send(hck, h, 0);
+		return true;
+	}
+#endif
+	if (hck->edge){
+		return http_send(hck, h) != -1;
+	}
+	/* Sent once the socket reports it is writable */
+	epoll_mod(hck, h->remote_socket, EPOLLIN | EPOLLOUT);
+	return true;
+}
+
+static bool io_connect(hck_handle* hck, struct hck_details* h, bool fastopen){
+#ifdef HCK_IO_URING
+	if (hck->backend == BACKEND_URING){
+		return uring_connect(hck, h);
+	}
+#endif
+	return epoll_connect(hck, h, fastopen);
+}
+
+// the address a host is tried at first, the last winner of a race if the host still resolves to it
+static const struct hck_addr& host_addr(const struct hck_host* host){
+	if (host->preferred.family != 0 && find(host->addrs.begin(), host->addrs.end(), host->preferred) != host->addrs.end()){
+		return host->preferred;
+	}
+	return host->addrs[0];
+}
+
+// the order a race tries the addresses in: the preferred one, then the families in turn (RFC 8305 section 4)
+static void race_order(const struct hck_host* host, vector<struct hck_addr>& order){
+	const struct hck_addr& first = host_addr(host);
+	vector<const struct hck_addr*> same, other;
+
+	for (size_t i = 0; i < host->addrs.size(); i++){
+		if (!(host->addrs[i] == first)){
+			(host->addrs[i].family == first.family ? same : other).push_back(&host->addrs[i]);
+		}
+	}
+
+	order.push_back(first);
+	for (size_t i = 0; i < max(same.size(), other.size()); i++){
+		if (i < other.size()){
+			order.push_back(*other[i]);
+		}
+		if (i < same.size()){
+			order.push_back(*same[i]);
+		}
+	}
+}
+
+// try the next address of a race
+static void race_next(hck_handle* hck, struct hck_race* r, uint64_t now){
+	uint32_t index = r->next++;
+	uint64_t deadline = hck->deadline;
+	uint32_t interval = hck->interval;
+
+	r->pending++;
+	r->next_at = now + config.happy_eyeballs_delay;
+
+	/* The answer may decide the race at once, the collecting client is not touched after that */
+	hck->deadline = r->deadline;
+	hck->interval = r->interval;
+	if (!check_add(hck, r->addrs[index], r->spec, now, r->collect, index)){
+		send_result(hck, r->collect, index, HCK_RESULT_FAIL);
+	}
+	hck->deadline = deadline;
+	hck->interval = interval;
+}
+
+// answer the request of a race, remembering the address that won it
+static void race_finish(hck_handle* hck, struct hck_race* r, const struct hck_addr* winner, uint16_t result){
+	struct hck_client* collect = r->collect;
+
+	r->done = true;
+	if (winner != NULL){
+		unordered_map<string, struct hck_host*>::iterator it = hck->hosts.find(r->key);
+		if (it != hck->hosts.end()){
+			it->second->preferred = *winner;
+		}
+		if (!(*winner == r->addrs[0])){
+			counters.fallbacks++;
+		}
+	}
+
+	send_result(hck, r->client, r->id, result);
+	client_release(r->client);
+
+	/* The tries still running finish on their own, their connections are pooled as usual */
+	collect->race = NULL;
+	collect->closed = true;
+	if (collect->refs == 0){
+		delete collect;
+	}
+}
+
+// the answer from one address of a race
+static void race_result(hck_handle* hck, struct hck_client* c, uint32_t index, uint16_t result){
+	struct hck_race* r = c->race;
+
+	r->pending--;
+	r->result = result;
+	if (result != HCK_RESULT_OK){
+		/* A failed address does not wait out the delay, handle_races tries the next one */
+		if (r->next < r->addrs.size()){
+			r->next_at = monotonic_ms();
+			return;
+		}
+		if (r->pending != 0){
+			return;
+		}
+	}
+
+	race_finish(hck, r, result == HCK_RESULT_OK ? &r->addrs[index] : NULL, result);
+}
+
+// race a request across the addresses of a host
+static void race_start(hck_handle* hck, struct hck_host* host, struct hck_spec* spec, uint64_t now, struct hck_client* c, uint32_t id){
+	struct hck_race* r = new struct hck_race;
+	struct hck_client* collect = new struct hck_client;
+
+	collect->fd = -1;
+	collect->refs = 0;
+	collect->closed = false;
+	collect->bulk = NULL;
+	collect->race = r;
+
+	r->client = c;
+	r->id = id;
+	r->collect = collect;
+	r->key.assign(host->name).append(1, '\0').append(host->port);
+	r->spec = spec;
+	race_order(host, r->addrs);
+	r->next = 0;
+	r->pending = 0;
+	r->deadline = hck->deadline;
+	r->interval = hck->interval;
+	r->result = HCK_RESULT_FAIL;
+	r->done = false;
+	c->refs++;
+
+	counters.raced++;
+	hck->races.push_back(r);
+	race_next(hck, r, now);
+}
+
+// try the next address of the races that are due, and drop the decided ones
+void handle_races(hck_handle& hck, uint64_t now){
+	for (size_t i = 0; i < hck.races.size();){
+		struct hck_race* r = hck.races[i];
+
+		if (!r->done && r->next < r->addrs.size() && r->next_at <= now){
+			if (r->deadline == 0 || r->deadline > now){
+				race_next(&hck, r, now);
+			}
+			else{
+				/* Past the poller's budget, what is running is all there will be */
+				r->next = r->addrs.size();
+				if (r->pending == 0){
+					race_finish(&hck, r, NULL, r->result);
+				}
+			}
+		}
+
+		if (r->done){
+			hck.races[i] = hck.races.back();
+			hck.races.pop_back();
+			delete r;
+			continue;
+		}
+		i++;
+	}
+}
+
+// when the next race is due to try another address, 0 if none is
+static uint64_t races_next(const hck_handle& hck){
+	uint64_t next = 0;
+
+	for (size_t i = 0; i < hck.races.size(); i++){
+		const struct hck_race* r = hck.races[i];
+
+		if (!r->done && r->next < r->addrs.size() && (next == 0 || r->next_at < next)){
+			next = r->next_at;
+		}
+	}
+	return next;
+}
+
+/*
+Start a check against the resolved addresses of a host. With a connection up
+to the address that answered last, or a single address, it goes straight
+there; otherwise the addresses are raced.
+*/
+static void check_host(hck_handle* hck, struct hck_host* host, struct hck_spec* spec, uint64_t now, struct hck_client* c, uint32_t id){
+	if (host->addrs.empty()){
+		send_result(hck, c, id, HCK_RESULT_FAIL);
+		return;
+	}
+
+	const struct hck_addr& addr = host_addr(host);
+	if (host->addrs.size() > 1 && config.happy_eyeballs_delay > 0){
+		struct hck_target_key key;
+
+		key.addr = addr;
+		key.spec = spec;
+		unordered_map<struct hck_target_key, struct hck_target*, struct hck_target_key_hash>::iterator it = hck->targets.find(key);
+		if (it == hck->targets.end() || it->second->connections == 0){
+			race_start(hck, host, spec, now, c, id);
+			return;
+		}
+	}
+
+	if (!check_add(hck, addr, spec, now, c, id)){
+		send_result(hck, c, id, HCK_RESULT_FAIL);
+	}
+}
+
+static void resolve_start(hck_handle* hck, struct hck_host* host, const string& key, uint64_t now){
+	host->resolving = true;
+	host->resolve_started = now;
+	hck->resolving.push_back(host);
+	hck->resolver.submit(key);
+}
+
+// answer everything still waiting on a host's first resolution
+static void resolve_finish(hck_handle* hck, struct hck_host* host, uint64_t now){
+	struct hck_waiter *w, *next;
+
+	w = host->waiting;
+	host->waiting = NULL;
+	for (; w != NULL; w = next){
+		next = w->next;
+		if (!w->client->closed){
+			/* The poller's budget still holds for the check once the name resolves */
+			hck->deadline = w->deadline;
+			hck->interval = w->interval;
+			check_host(hck, host, w->spec, now, w->client, w->id);
+			hck->deadline = 0;
+			hck->interval = 0;
+		}
+		client_release(w->client);
+		hck->waiter_slab.release(w);
+	}
+}
+
+// an address literal and numeric port, false if it is a host name to resolve
+static bool addr_parse(const char* name, const char* port, struct hck_addr* addr){
+	char* end;
+	long portnum;
+
+	portnum = strtol(port, &end, 10);
+	if (*end != 0 || *port == 0 || portnum <= 0 || portnum >= 65536){
+		return false;
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->port = htons(portnum);
+	if (inet_pton(AF_INET, name, addr->addr) == 1){
+		addr->family = AF_INET;
+	}
+	else if (inet_pton(AF_INET6, name, addr->addr) == 1){
+		addr->family = AF_INET6;
+		if (memcmp(addr->addr, v4mapped_prefix, sizeof(v4mapped_prefix)) == 0){
+			addr->family = AF_INET;
+			memmove(addr->addr, addr->addr + 12, 4);
+			memset(addr->addr + 4, 0, 12);
+		}
+	}
+	return addr->family != 0;
+}
+
+// the key of a host name in the resolution cache, built in the scratch string
+static string& host_key(hck_handle* hck, const char* name, const char* port){
+	string& key = hck->scratch;
+
+	key.assign(name);
+	key += '\0';
+	key += port;
+	return key;
+}
+
+/*
+Check a host given by name. Literal addresses skip the cache; names are served
+from it, a stale entry is used while it is refreshed in the background.
+getaddrinfo does not expose record TTLs, so entries live for DnsTtl and
+failures for DnsNegativeTtl.
+*/
+static void check_name(hck_handle* hck, const char* name, const char* port, struct hck_spec* spec, uint64_t now, struct hck_client* c, uint32_t id){
+	struct hck_addr addr;
+	struct hck_host* host;
+
+	if (addr_parse(name, port, &addr)){
+		if (!check_add(hck, addr, spec, now, c, id)){
+			send_result(hck, c, id, HCK_RESULT_FAIL);
+		}
+		return;
+	}
+
+	string& key = host_key(hck, name, port);
+
+	struct hck_host*& entry = hck->hosts[key];
+	if (entry == NULL){
+		entry = new struct hck_host;
+		entry->name = name;
+		entry->port = port;
+		entry->expires = 0;
+		entry->resolving = false;
+		entry->resolved = false;
+		entry->waiting = NULL;
+		memset(&entry->preferred, 0, sizeof(entry->preferred));
+	}
+	host = entry;
+	host->last_used = now;
+
+	if (host->resolved){
+		if (host->expires <= now && !host->resolving){
+			resolve_start(hck, host, key, now);
+		}
+		check_host(hck, host, spec, now, c, id);
+		return;
+	}
+
+	if (!waiter_add(hck, &host->waiting, c, id)){
+		send_result(hck, c, id, HCK_RESULT_FAIL);
+		return;
+	}
+	host->waiting->spec = spec;
+	host->waiting->deadline = hck->deadline;
+	host->waiting->interval = hck->interval;
+	if (!host->resolving){
+		resolve_start(hck, host, key, now);
+	}
+}
+
+// apply finished resolutions
+void handle_resolver(hck_handle& hck, uint64_t now){
+	vector<hck_resolver::result> results;
+
+	hck.resolver.collect(results);
+	for (size_t i = 0; i < results.size(); i++){
+		unordered_map<string, struct hck_host*>::iterator it = hck.hosts.find(results[i].key);
+		if (it == hck.hosts.end()){
+			continue;
+		}
+
+		struct hck_host* host = it->second;
+		if (results[i].addrs.empty()){
+			zabbix_log(LOG_LEVEL_DEBUG, "HCK: unable to resolve %s", host->name.c_str());
+		}
+
+		/* Keep serving the previous addresses if a refresh fails */
+		if (!results[i].addrs.empty() || !host->resolved){
+			host->addrs.swap(results[i].addrs);
+		}
+		host->expires = now + (host->addrs.empty() ? config.dns_negative_ttl : config.dns_ttl);
+		host->resolving = false;
+		host->resolved = true;
+		hck.resolving.erase(find(hck.resolving.begin(), hck.resolving.end(), host));
+
+		resolve_finish(&hck, host, now);
+	}
+}
+
+// something that can go into a request line or header as is
+static bool http_token(const char* s){
+	if (*s == 0){
+		return false;
+	}
+	for (; *s != 0; s++){
+		if ((unsigned char)*s <= ' ' || *s == 0x7f){
+			return false;
+		}
+	}
+	return true;
+}
+
+// the spec of a request, its bytes are built the first time it is seen
+static struct hck_spec* spec_get(hck_handle* hck, const char* method, const char* path, const char* host, uint64_t now){
+	struct hck_spec* spec;
+	string& key = hck->scratch;
+
+	key.assign(method);
+	key += '\0';
+	key += path;
+	key += '\0';
+	key += host;
+	key += '\0';
+
+	unordered_map<string, struct hck_spec*>::iterator it = hck->specs.find(key);
+	if (it != hck->specs.end()){
+		spec = it->second;
+	}
+	else{
+		spec = new struct hck_spec;
+		spec->key = key;
+		spec->request.append(method).append(" ").append(path).append(" HTTP/1.1\r\n");
+		spec->request.append("Host: ").append(host).append("\r\n\r\n");
+		spec->head = strcmp(method, "HEAD") == 0;
+		spec->refs = 0;
+		hck->specs[key] = spec;
+	}
+	spec->last_used = now;
+
+	return spec;
+}
+
+// the Host header naming the host checked, bracketed if it is an IPv6 address, with the port unless it is 80
+static const char* default_host(char* buf, size_t size, const char* name, const char* port){
+	bool v6 = strchr(name, ':') != NULL;
+
+	if (strcmp(port, "80") == 0){
+		snprintf(buf, size, v6 ? "[%s]" : "%s", name);
+	}
+	else{
+		snprintf(buf, size, v6 ? "[%s]:%s" : "%s:%s", name, port);
+	}
+	return buf;
+}
+
+// handle a request from a poller
+static void handle_request(hck_handle& hck, struct hck_client* c, const struct hck_frame& f, const char* payload, uint64_t now){
+	const char* fields[7] = { NULL, NULL, "", "", "", "", "" };
+	const char *p, *end, *method, *path, *host;
+	char hostbuf[HCK_MAX_PAYLOAD + 16];
+	int n = 0;
+
+	/* NUL terminated strings: host, port, then optionally method, path, Host header, the ms the poller waits and its interval in ms */
+	p = payload;
+	end = payload + f.length;
+	if (f.type == HCK_MSG_CHECK && f.length > 0 && payload[f.length - 1] == 0){
+		for (; p < end && n < 7; n++){
+			fields[n] = p;
+			p += strlen(p) + 1;
+		}
+	}
+	if (n < 2 || p != end || *fields[0] == 0 || *fields[1] == 0){
+		zabbix_log(LOG_LEVEL_WARNING, "HCK: invalid check request");
+		send_result(&hck, c, f.id, HCK_RESULT_FAIL);
+		return;
+	}
+
+	method = *fields[2] != 0 ? fields[2] : HCK_DEFAULT_METHOD;
+	path = *fields[3] != 0 ? fields[3] : HCK_DEFAULT_PATH;
+	host = *fields[4] != 0 ? fields[4] : default_host(hostbuf, sizeof(hostbuf), fields[0], fields[1]);
+
+	if (!http_token(method) || !http_token(path) || *path != '/' || !http_token(host)){
+		zabbix_log(LOG_LEVEL_WARNING, "HCK: invalid method, path or Host in check request");
+		send_result(&hck, c, f.id, HCK_RESULT_FAIL);
+		return;
+	}
+
+	hck.deadline = *fields[5] != 0 ? now + strtoul(fields[5], NULL, 10) : 0;
+	hck.interval = min(strtoul(fields[6], NULL, 10), (unsigned long)UINT32_MAX);
+	check_name(&hck, fields[0], fields[1], spec_get(&hck, method, path, host, now), now, c, f.id);
+	hck.deadline = 0;
+	hck.interval = 0;
+}
+
+/*
+Handle a bulk request: every target is checked at once, as a check request
+of its own with the default request, and the results go back together. The
+answers are collected by a client of the request's own, so each target is
+resolved, coalesced, cached and pooled like any other check.
+*/
+static void handle_bulk(hck_handle& hck, struct hck_client* c, const struct hck_frame& f, const char* payload, uint64_t now){
+	const char* end = payload + f.length;
+	const char* p = payload;
+	char hostbuf[HCK_MAX_PAYLOAD + 16];
+	vector<const char*> fields;
+	struct hck_client* collect;
+	struct hck_bulk* b;
+	uint64_t budget;
+
+	if (f.length > 0 && payload[f.length - 1] == 0){
+		for (; p < end; p += strlen(p) + 1){
+			fields.push_back(p);
+		}
+	}
+	if (fields.size() < 3 || fields.size() % 2 != 1 || fields.size() / 2 * sizeof(uint16_t) > HCK_MAX_PAYLOAD){
+		struct hck_frame r = { HCK_PROTOCOL_VERSION, HCK_MSG_RESULTS, 0, f.id };
+
+		zabbix_log(LOG_LEVEL_WARNING, "HCK: invalid bulk request");
+		client_write(&hck, c, &r, sizeof(r));
+		return;
+	}
+	budget = strtoul(fields[0], NULL, 10);
+
+	b = new struct hck_bulk;
+	b->client = c;
+	b->id = f.id;
+	b->pending = fields.size() / 2;
+	b->results.assign(b->pending, HCK_RESULT_FAIL);
+	c->refs++;
+
+	collect = new struct hck_client;
+	collect->fd = -1;
+	collect->refs = 0;
+	collect->closed = false;
+	collect->bulk = b;
+	collect->race = NULL;
+
+	counters.bulk += b->pending;
+	hck.deadline = budget != 0 ? now + budget : 0;
+	for (size_t i = 1; i < fields.size(); i += 2){
+		const char* name = fields[i];
+		const char* port = fields[i + 1];
+		uint32_t index = i / 2;
+
+		if (*name == 0 || *port == 0){
+			send_result(&hck, collect, index, HCK_RESULT_FAIL);
+			continue;
+		}
+		/* The last answer may free the collecting client, it is not touched after that */
+		check_name(&hck, name, port, spec_get(&hck, HCK_DEFAULT_METHOD, HCK_DEFAULT_PATH,
+			default_host(hostbuf, sizeof(hostbuf), name, port), now), now, collect, index);
+	}
+	hck.deadline = 0;
+}
+
+//send a value from worker -> process, none if there is no value
+static void send_value(hck_handle* hck, struct hck_client* c, uint32_t id, const uint64_t* value){
+	struct {
+		struct hck_frame f;
+		uint64_t value;
+	} __attribute__((packed)) msg;
+
+	msg.f.version = HCK_PROTOCOL_VERSION;
+	msg.f.type = HCK_MSG_VALUE;
+	msg.f.length = value != NULL ? sizeof(msg.value) : 0;
+	msg.f.id = id;
+	if (value != NULL){
+		msg.value = *value;
+	}
+
+	client_write(hck, c, &msg, sizeof(msg.f) + msg.f.length);
+}
+
+// answer a latency query from what the checks on the address measured, names are only looked up in the cache
+static void handle_latency(hck_handle& hck, struct hck_client* c, const struct hck_frame& f, const char* payload){
+	const char* fields[5] = { NULL, NULL, NULL, NULL, NULL };
+	const char* p = payload;
+	const char* end = payload + f.length;
+	struct hck_addr addr;
+	struct hck_latency* l;
+	uint64_t value;
+	double q;
+	int n = 0, phase, kind;
+
+	if (f.length > 0 && payload[f.length - 1] == 0){
+		for (; p < end && n < 5; n++){
+			fields[n] = p;
+			p += strlen(p) + 1;
+		}
+	}
+	if (n != 5 || p != end || (phase = latency_phase(fields[2])) == -1 || !latency_stat(fields[3], &q) ||
+		(kind = latency_kind(fields[4])) == -1){
+		zabbix_log(LOG_LEVEL_WARNING, "HCK: invalid latency request");
+		send_value(&hck, c, f.id, NULL);
+		return;
+	}
+
+	if (!addr_parse(fields[0], fields[1], &addr)){
+		unordered_map<string, struct hck_host*>::iterator it = hck.hosts.find(host_key(&hck, fields[0], fields[1]));
+		if (it == hck.hosts.end() || it->second->addrs.empty()){
+			send_value(&hck, c, f.id, NULL);
+			return;
+		}
+		addr = host_addr(it->second);
+	}
+
+	unordered_map<struct hck_addr, struct hck_latency*, struct hck_addr_hash>::iterator it = hck.latency.find(addr);
+	if (it == hck.latency.end()){
+		send_value(&hck, c, f.id, NULL);
+		return;
+	}
+	l = it->second;
+
+	if (q == 0){
+		value = l->last[kind][phase];
+	}
+	else if (kind == KIND_ALL){
+		value = hist_quantile(&l->hist[KIND_NEW][phase], &l->hist[KIND_REUSED][phase], q);
+	}
+	else{
+		value = hist_quantile(&l->hist[kind][phase], NULL, q);
+	}
+	send_value(&hck, c, f.id, value != 0 ? &value : NULL);
+}
+
+/* hck.stats counters, read straight from the worker's counters */
+static const struct {
+	const char* name;
+	size_t offset;
+} stats_counters[] = {
+	{ "checks", offsetof(struct hck_counters, checks) },
+	{ "checks.expired", offsetof(struct hck_counters, expired) },
+	{ "checks.retried", offsetof(struct hck_counters, retries) },
+	{ "checks.coalesced", offsetof(struct hck_counters, coalesced) },
+	{ "checks.pipelined", offsetof(struct hck_counters, pipelined) },
+	{ "checks.cached", offsetof(struct hck_counters, cached) },
+	{ "checks.scheduled", offsetof(struct hck_counters, scheduled) },
+	{ "checks.bulk", offsetof(struct hck_counters, bulk) },
+	{ "checks.overloaded", offsetof(struct hck_counters, overloaded) },
+	{ "checks.raced", offsetof(struct hck_counters, raced) },
+	{ "checks.fallbacks", offsetof(struct hck_counters, fallbacks) },
+	{ "keepalive.hits", offsetof(struct hck_counters, keepalive_hits) },
+	{ "keepalive.misses", offsetof(struct hck_counters, keepalive_misses) },
+	{ "keepalive.stale", offsetof(struct hck_counters, keepalive_stale) },
+	{ "keepalive.expired", offsetof(struct hck_counters, keepalive_expired) },
+	{ "keepalive.warmed", offsetof(struct hck_counters, warmed) },
+	{ "keepalive.evicted", offsetof(struct hck_counters, evicted) },
+	{ "tfo.fallbacks", offsetof(struct hck_counters, tfo_fallbacks) },
+	{ "tfo.accepted", offsetof(struct hck_counters, tfo_accepted) },
+	{ "tfo.skipped", offsetof(struct hck_counters, tfo_skipped) },
+	{ "loop.waits", offsetof(struct hck_counters, waits) },
+	{ "loop.busy", offsetof(struct hck_counters, busy_ns) },
+	{ "ipc.requests", offsetof(struct hck_counters, requests) },
+	{ "syscalls.epoll_wait", offsetof(struct hck_counters, epoll_wait) },
+	{ "syscalls.epoll_ctl", offsetof(struct hck_counters, epoll_ctl) },
+	{ "syscalls.io_uring_enter", offsetof(struct hck_counters, uring_enter) },
+	{ "syscalls.socket", offsetof(struct hck_counters, socket) },
+	{ "syscalls.connect", offsetof(struct hck_counters, connect) },
+	{ "syscalls.send", offsetof(struct hck_counters, send) },
+	{ "syscalls.recv", offsetof(struct hck_counters, recv) },
+	{ "syscalls.close", offsetof(struct hck_counters, close) },
+};
+
+// a worker metric by name, counters since the worker started or gauges counted now. False if there is no such metric
+static bool stats_value(hck_handle& hck, const char* name, uint64_t* value){
+	static const char* states[] = { NULL, "sockets.connecting", "sockets.writing", "sockets.reading", "sockets.keepalive", "sockets.recovery" };
+
+	for (size_t i = 0; i < sizeof(stats_counters) / sizeof(stats_counters[0]); i++){
+		if (strcmp(name, stats_counters[i].name) == 0){
+			*value = *(const uint64_t*)((const char*)&counters + stats_counters[i].offset);
+			return true;
+		}
+	}
+
+	if (strcmp(name, "loop.events") == 0){
+		*value = counters.epoll_events + counters.completions;
+	}
+	else if (strcmp(name, "syscalls") == 0){
+		*value = counters.epoll_wait + counters.epoll_ctl + counters.uring_enter + counters.socket +
+			counters.connect + counters.send + counters.recv + counters.close;
+	}
+	else if (strcmp(name, "targets") == 0){
+		*value = hck.targets.size();
+	}
+	else if (strcmp(name, "hosts") == 0){
+		*value = hck.hosts.size();
+	}
+	else if (strcmp(name, "hosts.resolving") == 0){
+		*value = hck.resolving.size();
+	}
+	else if (strcmp(name, "slab.capacity") == 0){
+		*value = hck.slab.capacity();
+	}
+	else if (strcmp(name, "ipc.clients") == 0 || strcmp(name, "ipc.queued") == 0){
+		/* Replies not yet taken by the pollers */
+		bool queued = name[4] == 'q';
+		*value = 0;
+		for (int i = 0; i < hck.clients.limit(); i++){
+			struct hck_client* c = hck.clients.find(i);
+			if (c != NULL){
+				*value += queued ? c->out.size() : 1;
+			}
+		}
+	}
+	else if (strcmp(name, "sockets.budget") == 0){
+		*value = hck.fd_budget;
+	}
+	else if (strncmp(name, "sockets", 7) == 0){
+		int state = 0;
+
+		if (name[7] != 0){
+			for (state = 1; state < (int)(sizeof(states) / sizeof(states[0])) && strcmp(name, states[state]) != 0; state++);
+			if (state == (int)(sizeof(states) / sizeof(states[0]))){
+				return false;
+			}
+		}
+
+		*value = 0;
+		for (int i = 0; i < hck.sockets.limit(); i++){
+			struct hck_details* h = hck.sockets.find(i);
+			if (h != NULL && (state == 0 || h->state == state)){
+				(*value)++;
+			}
+		}
+	}
+	else{
+		return false;
+	}
+
+	return true;
+}
+
+// answer a hck.stats query for this worker
+static void handle_stats(hck_handle& hck, struct hck_client* c, const struct hck_frame& f, const char* payload){
+	uint64_t value;
+
+	if (f.length == 0 || payload[f.length - 1] != 0 || strlen(payload) != (size_t)f.length - 1 ||
+		!stats_value(hck, payload, &value)){
+		send_value(&hck, c, f.id, NULL);
+		return;
+	}
+	send_value(&hck, c, f.id, &value);
+}
+
+// handle internal communication
+void handle_internalsock(hck_handle& hck, struct hck_client* c, uint32_t events, uint64_t now){
+	char buf[READSIZE];
+	struct hck_frame f;
+	size_t offset = 0;
+	int rc;
+
+	if (events & EPOLLOUT){
+		client_flush(&hck, c);
+	}
+
+	if (events & EPOLLIN){
+		for (;;){
+			rc = recv(c->fd, buf, sizeof(buf), 0);
+			if (rc > 0){
+				c->in.insert(c->in.end(), buf, buf + rc);
+				continue;
+			}
+			if (rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+				events |= EPOLLHUP;
+			}
+			break;
+		}
+
+		/* Process every complete frame */
+		while (c->in.size() - offset >= sizeof(f)){
+			memcpy(&f, &c->in[offset], sizeof(f));
+			if (f.version != HCK_PROTOCOL_VERSION || f.length > HCK_MAX_PAYLOAD){
+				zabbix_log(LOG_LEVEL_WARNING, "HCK: protocol error on client socket %d", c->fd);
+				events |= EPOLLHUP;
+				break;
+			}
+			if (c->in.size() - offset < sizeof(f) + f.length){
+				break;
+			}
+
+			counters.requests++;
+			if (f.type == HCK_MSG_LATENCY){
+				handle_latency(hck, c, f, &c->in[offset + sizeof(f)]);
+			}
+			else if (f.type == HCK_MSG_STATS){
+				handle_stats(hck, c, f, &c->in[offset + sizeof(f)]);
+			}
+			else if (f.type == HCK_MSG_BULK){
+				handle_bulk(hck, c, f, &c->in[offset + sizeof(f)], now);
+			}
+			else{
+				handle_request(hck, c, f, &c->in[offset + sizeof(f)], now);
+			}
+			offset += sizeof(f) + f.length;
+		}
+		c->in.erase(c->in.begin(), c->in.begin() + offset);
+	}
+
+	if (events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)){
+		zabbix_log(LOG_LEVEL_DEBUG, "HCK: closing client socket %d", c->fd);
+		client_close(&hck, c);
+	}
+}
+
+/*
+State file of a worker: a header, then a record per target followed by the
+key of its request. It is only read back by a worker on the same host, fields
+are in host byte order.
+*/
+#define STATE_MAGIC 0x534b4348	// "HCKS"
+#define STATE_VERSION 1
+#define STATE_PERSISTENT 1	// the server kept its connections open
+#define STATE_TFO_ACCEPTED 2	// the server took requests in the SYN
+#define STATE_TFO_FALLBACK 4	// the server did not take TCP Fast Open
+
+struct hck_state_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+};
+
+struct hck_state_record {
+	struct hck_addr addr;
+	uint32_t interval;
+	uint16_t key_len;
+	uint8_t flags;
+	uint8_t pad;
+	uint64_t latency[3][PHASE_COUNT];	// the last of each phase, by hck_kind
+};
+
+// the flags a target is saved with
+static uint8_t state_flags(const struct hck_target* t){
+	return (t->persistent ? STATE_PERSISTENT : 0) | (t->tfo == TFO_ACCEPTED ? STATE_TFO_ACCEPTED : 0) |
+		(t->tfo == TFO_FALLBACK ? STATE_TFO_FALLBACK : 0);
+}
+
+// what the saved targets come to, latency aside as it moves with every check. Independent of their order
+static uint32_t state_hash(hck_handle& hck){
+	uint32_t hash = 0;
+
+	for (unordered_map<struct hck_target_key, struct hck_target*, struct hck_target_key_hash>::iterator it = hck.targets.begin(); it != hck.targets.end(); it++){
+		struct hck_target* t = it->second;
+		uint8_t flags = state_flags(t);
+		uint32_t h;
+
+		h = hck_hash(&t->addr, sizeof(t->addr));
+		h = hck_hash(&t->interval, sizeof(t->interval), h);
+		h = hck_hash(&flags, sizeof(flags), h);
+		hash += hck_hash(t->spec->key.data(), t->spec->key.size(), h);
+	}
+	return hash;
+}
+
+/*
+Write the known targets, to a temporary file renamed over the old one so a
+crash leaves either whole. This is blocking file I/O in the event loop: it
+runs at most every STATE_SAVE_INTERVAL, only if the targets changed, and on
+exit, when the latency is brought up to date as well.
+*/
+static void state_save(hck_handle& hck, bool changed_only){
+	struct hck_state_header hdr;
+	struct hck_state_record r;
+	string tmp = hck.state_path + ".tmp";
+	uint32_t hash = state_hash(hck);
+	FILE* f;
+	bool ok;
+
+	if (changed_only && hash == hck.state_hash){
+		return;
+	}
+
+	f = fopen(tmp.c_str(), "w");
+	if (f == NULL){
+		zabbix_log(LOG_LEVEL_WARNING, "HCK: unable to write state file %s: %s", tmp.c_str(), strerror(errno));
+		return;
+	}
+
+	hdr.magic = STATE_MAGIC;
+	hdr.version = STATE_VERSION;
+	hdr.count = hck.targets.size();
+	ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+
+	for (unordered_map<struct hck_target_key, struct hck_target*, struct hck_target_key_hash>::iterator it = hck.targets.begin(); ok && it != hck.targets.end(); it++){
+		struct hck_target* t = it->second;
+
+		memset(&r, 0, sizeof(r));
+		r.addr = t->addr;
+		r.interval = t->interval;
+		r.key_len = t->spec->key.size();
+		r.flags = state_flags(t);
+		memcpy(r.latency, t->latency->last, sizeof(r.latency));
+		ok = fwrite(&r, sizeof(r), 1, f) == 1 && fwrite(t->spec->key.data(), r.key_len, 1, f) == 1;
+	}
+
+	if (fclose(f) != 0 || !ok || rename(tmp.c_str(), hck.state_path.c_str()) == -1){
+		zabbix_log(LOG_LEVEL_WARNING, "HCK: unable to write state file %s: %s", hck.state_path.c_str(), strerror(errno));
+		unlink(tmp.c_str());
+		return;
+	}
+	hck.state_hash = hash;
+}
+
+/*
+Bring back the targets of the last run, they are connected to at WarmRate
+before the pollers ask for them. Scheduled targets are scheduled again. A
+missing file is not an error, a damaged one is ignored from the first bad
+record.
+*/
+static void state_load(hck_handle& hck, uint64_t now){
+	struct hck_state_header hdr;
+	struct hck_state_record r;
+	char key[HCK_MAX_PAYLOAD + 1];
+	FILE* f;
+
+	f = fopen(hck.state_path.c_str(), "r");
+	if (f == NULL){
+		return;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != STATE_MAGIC || hdr.version != STATE_VERSION){
+		zabbix_log(LOG_LEVEL_WARNING, "HCK: ignoring state file %s of another version", hck.state_path.c_str());
+		fclose(f);
+		return;
+	}
+
+	for (uint32_t i = 0; i < hdr.count; i++){
+		const char *method, *path, *host;
+
+		if (fread(&r, sizeof(r), 1, f) != 1 || r.key_len == 0 || r.key_len > HCK_MAX_PAYLOAD ||
+			fread(key, r.key_len, 1, f) != 1 || key[r.key_len - 1] != 0 || (r.addr.family != AF_INET && r.addr.family != AF_INET6)){
+			zabbix_log(LOG_LEVEL_WARNING, "HCK: state file %s is damaged, %u of %u targets read", hck.state_path.c_str(), i, hdr.count);
+			break;
+		}
+
+		/* The key is "method\0path\0host\0" */
+		method = key;
+		path = method + strlen(method) + 1;
+		host = path < key + r.key_len ? path + strlen(path) + 1 : key + r.key_len;
+		if (host >= key + r.key_len || host + strlen(host) + 1 != key + r.key_len ||
+			!http_token(method) || !http_token(path) || !http_token(host)){
+			continue;
+		}
+
+		struct hck_target* t = target_get(&hck, r.addr, spec_get(&hck, method, path, host, now), now);
+		t->persistent = (r.flags & STATE_PERSISTENT) != 0;
+		if (r.flags & STATE_TFO_ACCEPTED){
+			t->tfo = TFO_ACCEPTED;
+		}
+		else if (r.flags & STATE_TFO_FALLBACK){
+			tfo_give_up(t, now);
+		}
+		for (int k = 0; k < 3; k++){
+			for (int p = 0; p < PHASE_COUNT; p++){
+				if (t->latency->last[k][p] == 0){
+					t->latency->last[k][p] = r.latency[k][p];
+				}
+			}
+		}
+		if (r.interval != 0 && t->next_run == 0){
+			/* As if just asked for, it stops once the pollers do not */
+			t->interval = r.interval;
+			t->last_request = now;
+			schedule_run(&hck, t, t->interval / 2, now);
+		}
+
+		hck.warm.push_back(target_key(t));
+	}
+
+	fclose(f);
+	hck.warm_started = now;
+	hck.warm_done = 0;
+	zabbix_log(LOG_LEVEL_DEBUG, "HCK: %zu targets read from %s", hck.warm.size(), hck.state_path.c_str());
+}
+
+// open connections to the saved targets, no faster than WarmRate
+void handle_warm(hck_handle& hck, uint64_t now){
+	uint64_t allowed = (now - hck.warm_started) * config.warm_rate / 1000 + 1;
+
+	while (!hck.warm.empty() && hck.warm_done < allowed){
+		unordered_map<struct hck_target_key, struct hck_target*, struct hck_target_key_hash>::iterator it = hck.targets.find(hck.warm.front());
+		hck.warm.pop_front();
+
+		/* A poller or the schedule got there first */
+		if (it == hck.targets.end() || it->second->connections != 0 || it->second->inflight != NULL){
+			continue;
+		}
+
+		/* Out of sockets, the rest of the warm start is dropped */
+		if (it->second->idle.empty() && !fd_reserve(&hck)){
+			hck.warm.clear();
+			break;
+		}
+
+		/* A check with nobody waiting, its connection goes to the pool and its result is kept */
+		hck.warm_done++;
+		counters.warmed++;
+		check_start(&hck, it->second, now);
+	}
+}
+
+// expire the checks and keepalives that are due
+void handle_cleanup(hck_handle& hck, uint64_t now){
+	struct hck_details* h;
+
+	while ((h = hck.timers.pop(now)) != NULL){
+		/* Hold on to the pool minimum while the target is still in use */
+		if (h->state == hck_details::keepalive && h->target->idle.size() <= (size_t)config.keepalive_min &&
+			h->target->last_used + TARGET_TTL > now){
+			pool_expiry(&hck, h, now + config.timeout_post);
+			continue;
+		}
+
+		zabbix_log(LOG_LEVEL_WARNING, "Expiring socket %d in state %d", h->remote_socket, h->state);
+		if (h->state == hck_details::keepalive){
+			counters.keepalive_expired++;
+		}
+		else{
+			counters.expired++;
+
+			/* The round trips may have grown, back off as a retransmission timeout would */
+			uint64_t timeout = timeout_for(h->target, h->first);
+			if (h->first){
+				rtt_backoff(&h->target->connect_rtt, timeout, config.timeout_new);
 			}
-			goto send_failure;
+			rtt_backoff(&h->target->response_rtt, timeout, config.timeout_recover);
 		}
 
-		if (rc > i){
-			i -= 1;
-			if (respbuff[i] > '0' && respbuff[i] < '5'){
-				uint8_t nls = 0;
-				//minimum of 2 places, this char and space
-				//4 would be standards compliant for "200 "
-				for (i+=2; i < rc; i++){
-					if (respbuff[i] == '\n'){
-						if (++nls == 2){
-							goto send_ok;
-						}
-					}
-					else if (respbuff[i] != '\r'){
-						nls = 0;
-					}
-				}
+		if (h->waiters != NULL || h->target->inflight == h){
+			result_store(h->target, HCK_RESULT_FAIL, now);
+		}
+		check_answer(&hck, h, HCK_RESULT_FAIL);
+		http_cleanup(hck, h);
+	}
+
+	hck.timers.compact(hck.sockets.size());
+	hck.idle_lru.compact(hck.sockets.size());
 
-				//Position signifies number of newlines in reading2
-				h->state = hck_details::reading2;
-				h->position = nls;
+	/* Do not keep checks waiting on a resolver that does not answer */
+	for (size_t i = 0; i < hck.resolving.size(); i++){
+		struct hck_host* host = hck.resolving[i];
+		if (host->waiting != NULL && host->resolve_started + config.timeout_new <= now){
+			zabbix_log(LOG_LEVEL_WARNING, "HCK: timed out resolving %s", host->name.c_str());
+			resolve_finish(&hck, host, now);
+		}
+	}
+
+	if (!hck.state_path.empty() && now >= hck.next_state_save){
+		hck.next_state_save = now + STATE_SAVE_INTERVAL;
+		state_save(hck, true);
+	}
+
+	/* Forget targets that have not been checked in a while */
+	if (now >= hck.next_target_sweep){
+		hck.next_target_sweep = now + TARGET_TTL / 10;
+
+		for (unordered_map<struct hck_target_key, struct hck_target*, struct hck_target_key_hash>::iterator it = hck.targets.begin(); it != hck.targets.end();){
+			struct hck_target* t = it->second;
+			if (t->connections == 0 && t->last_used + TARGET_TTL <= now){
+				t->spec->refs--;
+				t->latency->refs--;
+				delete t;
+				it = hck.targets.erase(it);
 			}
 			else{
-				zabbix_log(LOG_LEVEL_WARNING, "HCK: invalid response (char: %d)\n", respbuff[i] - '0');
-				goto send_failure;
+				it++;
 			}
 		}
-		else {
-			h->position += rc;
+
+		for (unordered_map<string, struct hck_host*>::iterator it = hck.hosts.begin(); it != hck.hosts.end();){
+			struct hck_host* host = it->second;
+			if (!host->resolving && host->last_used + TARGET_TTL <= now){
+				delete host;
+				it = hck.hosts.erase(it);
+			}
+			else{
+				it++;
+			}
 		}
-	}
 
+		/* Latency is kept while a target on the address is, and a while after it was last measured */
+		for (unordered_map<struct hck_addr, struct hck_latency*, struct hck_addr_hash>::iterator it = hck.latency.begin(); it != hck.latency.end();){
+			struct hck_latency* l = it->second;
+			if (l->refs == 0 && l->last_used + TARGET_TTL <= now){
+				delete l;
+				it = hck.latency.erase(it);
+			}
+			else{
+				it++;
+			}
+		}
 
-	if (h->state == hck_details::reading2){
-		rc = recv(e.data.fd, respbuff, sizeof(respbuff), 0);
-		uint8_t nls = h->position;
-		for (int i = 0; i < rc; i++){
-			if (respbuff[i] == '\n'){
-				if (++nls == 2){
-					goto send_ok;
-				}
+		/* Requests go once no target uses them */
+		for (unordered_map<string, struct hck_spec*>::iterator it = hck.specs.begin(); it != hck.specs.end();){
+			struct hck_spec* spec = it->second;
+			if (spec->refs == 0 && spec->last_used + TARGET_TTL <= now){
+				delete spec;
+				it = hck.specs.erase(it);
 			}
-			else if (respbuff[i] != '\r'){
-				nls = 0;
+			else{
+				it++;
 			}
 		}
-		h->position = nls;
 	}
-	else if (h->state == hck_details::keepalive){
-		rc = recv(e.data.fd, respbuff, sizeof(respbuff), 0);
-		if (rc == -1){
-			zabbix_log(LOG_LEVEL_WARNING, "Keepalive connection closing, no longer open");
-			http_cleanup(hck, h);
-			return;
+}
+
+// each worker listens on its own abstract socket, "hck" followed by the worker number
+static socklen_t worker_socket_addr(struct sockaddr_un* addr, int worker){
+	int len;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "%s%d", config.socket_name, worker);
+
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+int create_listener(int worker){
+	int fd;
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		perror("socket error");
+		return -1;
+	}
+
+	addr_len = worker_socket_addr(&addr, worker);
+
+	if (bind(fd, (struct sockaddr*)&addr, addr_len) == -1) {
+		zabbix_log(LOG_LEVEL_WARNING, "HCK: unable to bind worker socket %s%d: %s%s", config.socket_name, worker, strerror(errno),
+			errno == EADDRINUSE ? ", another instance uses this Socket name" : "");
+		close(fd);
+		return -1;
+	}
+
+	if (listen(fd, config.listen_backlog) == -1) {
+		perror("listen error");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+bool set_blocking_mode(const int &socket, bool is_blocking)
+{
+	bool ret = true;
+
+	const int flags = fcntl(socket, F_GETFL, 0);
+	ret = 0 == fcntl(socket, F_SETFL, is_blocking ? (flags ^ O_NONBLOCK) : (flags | O_NONBLOCK));	
+
+	return ret;
+}
+
+/*
+The check sockets a worker may have open. The soft RLIMIT_NOFILE is raised to
+the hard one, and a tenth of it (at least FD_RESERVE) is left for the pollers'
+connections and the worker itself.
+*/
+static size_t fd_budget(int worker){
+	struct rlimit rl;
+	size_t limit, budget;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1){
+		return config.fd_budget > 0 ? config.fd_budget : SIZE_MAX;
+	}
+	if (rl.rlim_cur < rl.rlim_max && rl.rlim_max != RLIM_INFINITY){
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1){
+			getrlimit(RLIMIT_NOFILE, &rl);
 		}
 	}
-	else if (h->state == hck_details::recovery){
-		if (e.events & EPOLLHUP || e.events & EPOLLRDHUP || e.events & EPOLLERR){
-			zabbix_log(LOG_LEVEL_WARNING, "Keepalive recovery connection closing, no longer open");
-			h->expires = 0;
-			http_cleanup(hck, h);
-			return;
+	if (rl.rlim_cur == RLIM_INFINITY){
+		return config.fd_budget > 0 ? config.fd_budget : SIZE_MAX;
+	}
+
+	limit = rl.rlim_cur;
+	budget = limit > 2 * FD_RESERVE ? limit - max((size_t)FD_RESERVE, limit / 10) : limit / 2;
+	if (config.fd_budget > 0){
+		if ((size_t)config.fd_budget > budget){
+			zabbix_log(LOG_LEVEL_WARNING, "HCK: FdBudget %d is over what the open file limit of %zu allows, worker #%d uses %zu",
+				config.fd_budget, limit, worker + 1, budget);
+		}
+		else{
+			budget = config.fd_budget;
 		}
+	}
+	return budget;
+}
 
-		// Place back into wiritng
-		h->state = hck_details::writing;
-		assert(h->position == 0);
+/*
+Main loop for processing check requests
+*/
+void main_thread(int worker){
+	int n, timeout;
+	hck_handle hck;
+	uint64_t now, next, woken;
+	int fd;
+
+	vector<struct epoll_event> events(MAXEVENTS);
+	struct epoll_event e;
+	struct hck_details* h;
+	struct hck_client* c;
+
+	hck.epfd = epoll_create(1024);
+	hck.next_target_sweep = 0;
+	hck.deadline = 0;
+	hck.interval = 0;
+	hck.warm_started = 0;
+	hck.warm_done = 0;
+	hck.seed = (uint32_t)monotonic_ns() ^ (uint32_t)(worker + 1) * 2654435761u;
+	if (hck.seed == 0){
+		hck.seed = 1;
 	}
+	hck.backend = BACKEND_EPOLL;
+#ifdef HCK_IO_URING
+	bool epoll_armed = false;
 
-	if (e.events & EPOLLOUT == 0 && e.events & EPOLLIN == 0 && (e.events & EPOLLHUP || e.events & EPOLLRDHUP)){
-		if (h->state == hck_details::keepalive){
-			zabbix_log(LOG_LEVEL_WARNING, "Keepalive connection closed");
-			http_cleanup(hck, h);
-			return;
+	if (config.backend == BACKEND_URING){
+		if (hck.ring.setup(URING_ENTRIES)){
+			hck.backend = BACKEND_URING;
 		}
 		else{
-			zabbix_log(LOG_LEVEL_WARNING, "HCK: connection interrupted\n");
-			goto send_failure;
+			zabbix_log(LOG_LEVEL_WARNING, "HCK: io_uring is not available (%s), using epoll", strerror(errno));
 		}
 	}
+#else
+	if (config.backend == BACKEND_URING){
+		zabbix_log(LOG_LEVEL_WARNING, "HCK: built without io_uring, using epoll");
+	}
+#endif
+	hck.edge = hck.backend == BACKEND_EPOLL && config.edge_triggered;
+	hck.fd_budget = fd_budget(worker);
+	
+	/* Create internal listener */
+	fd = create_listener(worker);
+	if (fd == -1){
+		close(hck.epfd);
+		return;
+	}
 
-	return;
+	/* Add the listener to EPOLL */
+	e.data.fd = fd;
+	e.events = EPOLLIN;
+	epoll_ctl(hck.epfd, EPOLL_CTL_ADD, fd, &e);
 
-send_ok:
-	if (!send_result(&hck, h->client_socket, 1)){
-		zabbix_log(LOG_LEVEL_WARNING, "Failed to send ok: %s", strerror(errno));
-		http_cleanup(hck, h);
+	/* And the resolver completions */
+	if (!hck.resolver.start(config.dns_threads)){
+		zabbix_log(LOG_LEVEL_WARNING, "HCK: unable to start the resolver");
+		close(fd);
+		close(hck.epfd);
 		return;
 	}
-	else{
-		h->position = 0;
-		h->state = hck_details::keepalive;
-		h->expires = now + TIMEOUT_POST;
+	e.data.fd = hck.resolver.fd;
+	e.events = EPOLLIN;
+	epoll_ctl(hck.epfd, EPOLL_CTL_ADD, hck.resolver.fd, &e);
+
+	/* Connect to the targets of the last run before the pollers ask for them */
+	if (!config.state_file.empty()){
+		char suffix[16];
+
+		snprintf(suffix, sizeof(suffix), ".%d", worker);
+		hck.state_path = config.state_file + suffix;
+		now = monotonic_ms();
+		state_load(hck, now);
+		hck.state_hash = state_hash(hck);
+		hck.next_state_save = now + STATE_SAVE_INTERVAL;
+	}
 
-		/* If a keepalive already exists, don't re-add */
-		if (hck.keepalived.find(h->remote_connection) != hck.keepalived.end()) {
-			assert(hck.keepalived[h->remote_connection] != h->remote_socket);
-			zabbix_log(LOG_LEVEL_WARNING, "Extra connection was opened, no longer needed - a keepalived connection exists.");
-			http_cleanup(hck, h);
+	zabbix_log(LOG_LEVEL_WARNING, "Zabbix HCK worker #%d started", worker + 1);
+
+	while (running){
+		/* Sleep until the next check, keepalive or scheduled run is due */
+		next = hck.timers.next();
+		if (hck.schedule.next() != 0 && (next == 0 || hck.schedule.next() < next)){
+			next = hck.schedule.next();
 		}
-		else 
+		if (races_next(hck) != 0 && (next == 0 || races_next(hck) < next)){
+			next = races_next(hck);
+		}
+		if (!hck.warm.empty()){
+			uint64_t warm = monotonic_ms() + max(1, 1000 / config.warm_rate);
+			next = next == 0 ? warm : min(next, warm);
+		}
+		timeout = -1;
+		if (next != 0){
+			now = monotonic_ms();
+			timeout = next > now ? (int)min(next - now, (uint64_t)INT_MAX) : 0;
+		}
+
+#ifdef HCK_IO_URING
+		if (hck.backend == BACKEND_URING){
+			struct io_uring_cqe* cqe;
+			bool epoll_ready = false;
+
+			/* The internal sockets stay on epoll, the ring tells when to look at them */
+			if (!epoll_armed){
+				struct io_uring_sqe* sqe = hck.ring.sqe();
+				sqe->opcode = IORING_OP_POLL_ADD;
+				sqe->fd = hck.epfd;
+				sqe->poll32_events = POLLIN;
+				sqe->user_data = URING_EPOLL;
+				epoll_armed = true;
+			}
+
+			hck.ring.wait(timeout);
+
+			woken = monotonic_ns();
+			now = woken / 1000000;
+			while ((cqe = hck.ring.peek()) != NULL){
+				uint64_t user_data = cqe->user_data;
+				int res = cqe->res;
+
+				hck.ring.advance();
+				counters.completions++;
+				if (user_data == URING_EPOLL){
+					epoll_armed = false;
+					epoll_ready = true;
+				}
+				else{
+					handle_uring(hck, user_data, res, now);
+				}
+			}
+
+			n = 0;
+			if (epoll_ready){
+				n = epoll_wait(hck.epfd, &events[0], events.size(), 0);
+				counters.epoll_wait++;
+			}
+		}
+		else
+#endif
 		{
-			hck.keepalived[h->remote_connection] = h->remote_socket;
+			n = epoll_wait(hck.epfd, &events[0], events.size(), timeout);
+			counters.epoll_wait++;
 
-			//Only get read events for keepalive
-			e.events = EPOLLIN;
-			rc = epoll_ctl(hck.epfd, EPOLL_CTL_MOD, e.data.fd, &e);
+			/* Update timestamp once per loop */
+			woken = monotonic_ns();
+			now = woken / 1000000;
+		}
+
+		if (n > 0){
+			counters.epoll_events += n;
+
+			/* Under load drain the ready list in fewer waits */
+			if ((size_t)n == events.size() && events.size() < MAXEVENTS_LIMIT){
+				events.resize(events.size() * 2);
+			}
+		}
+
+		while (n > 0){
+			n--;
+
+			e = events[n];
+
+			if ((h = hck.sockets.find(e.data.fd)) != NULL){ /* handle events for the checks */
+				handle_http(hck, h, e, now);
+			}
+			else if ((c = hck.clients.find(e.data.fd)) != NULL){ /* handle events for a connection to the main thread */
+				handle_internalsock(hck, c, e.events, now);
+			}
+			else if (e.data.fd == hck.resolver.fd){
+				handle_resolver(hck, now);
+			}
+			else if (e.data.fd == fd){ 
+				/* Handle new connections to the main thread */
+				if (e.events & EPOLLIN){
+					/* Accept & Add to EPOLL */
+					e.data.fd = accept4(e.data.fd, 0, 0, SOCK_NONBLOCK);
+					if (e.data.fd == -1){
+						zabbix_log(LOG_LEVEL_WARNING, "Unable to accept internal communication socket: %s", strerror(errno));
+						continue;
+					}
+
+					c = new struct hck_client;
+					c->fd = e.data.fd;
+					c->refs = 0;
+					c->closed = false;
+					c->bulk = NULL;
+					c->race = NULL;
+					hck.clients.insert(c->fd, c);
+
+					e.events = EPOLLIN | EPOLLRDHUP;
+					epoll_ctl(hck.epfd, EPOLL_CTL_ADD, e.data.fd, &e);
+				}
+				else{
+					goto cleanup;
+					return;
+				}
+			}
 		}
+
+		handle_races(hck, now);
+		handle_schedule(hck, now);
+		handle_warm(hck, now);
+		handle_cleanup(hck, now);
+
+		counters.waits++;
+		counters.busy_ns += monotonic_ns() - woken;
 	}
-	return;
-send_failure:
-	if (h->state != hck_details::keepalive){
-		send_result(&hck, h->client_socket, 0);
+
+cleanup:
+	zabbix_log(LOG_LEVEL_WARNING, "Zabbix HCK cleanup");
+
+	if (!hck.state_path.empty()){
+		state_save(hck, false);
+	}
+
+	close(fd);
+	close(hck.epfd);
+
+	for (int i = 0; i < hck.sockets.limit(); i++){
+		h = hck.sockets.find(i);
+		if (h != NULL){
+			check_answer(&hck, h, HCK_RESULT_FAIL);
+			close(h->remote_socket);
+		}
+	}
+
+	for (unordered_map<string, struct hck_host*>::iterator it = hck.hosts.begin(); it != hck.hosts.end(); it++){
+		waiters_answer(&hck, it->second->waiting, HCK_RESULT_FAIL);
+		delete it->second;
+	}
+
+	for (size_t i = 0; i < hck.races.size(); i++){
+		delete hck.races[i];
+	}
+
+	for (int i = 0; i < hck.clients.limit(); i++){
+		c = hck.clients.find(i);
+		if (c != NULL){
+			client_close(&hck, c);
+		}
+	}
+
+	for (unordered_map<struct hck_target_key, struct hck_target*, struct hck_target_key_hash>::iterator it = hck.targets.begin(); it != hck.targets.end(); it++){
+		delete it->second;
+	}
+
+	for (unordered_map<string, struct hck_spec*>::iterator it = hck.specs.begin(); it != hck.specs.end(); it++){
+		delete it->second;
+	}
+
+	for (unordered_map<struct hck_addr, struct hck_latency*, struct hck_addr_hash>::iterator it = hck.latency.begin(); it != hck.latency.end(); it++){
+		delete it->second;
 	}
-	http_cleanup(hck, h);
-	return;
-send_retry:
-	send_result(&hck, h->client_socket, 3);
-	http_cleanup(hck, h);
-	return;
 }
 
-// handle internal communication
-void handle_internalsock(hck_handle& hck, int socket, time_t now){
-	struct {
-		struct sockaddr sa;
-		struct addrinfo servinfo;
-	} buf;
-	int rc;
+int connect_to_hck(int worker){
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	int fd;
+
+	//create new unix socket, non blocking so that a worker with a full backlog fails the connect
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+		perror("socket error");
+		return -1;
+	}
+
+	//setup unix socket address
+	addr_len = worker_socket_addr(&addr, worker);
+
+	//connect to unix socket
+	if (connect(fd, (struct sockaddr*)&addr, addr_len) == -1) {
+		perror("connect error");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+// connections from this process to each worker
+int hck_fds[HCK_MAX_WORKERS];
+
+// (re)connect to the worker if required
+static int worker_fd(int worker){
+	char buffer[1] = { 0 };
+
+	if (hck_fds[worker] == -1)
+	{
+		hck_fds[worker] = connect_to_hck(worker);
+	}
+	else if (send(hck_fds[worker], &buffer, 0, 0) == -1)
+	{
+		close(hck_fds[worker]);
+		hck_fds[worker] = connect_to_hck(worker);
+	}
+
+	return hck_fds[worker];
+}
+
+static void worker_reset(int worker){
+	if (hck_fds[worker] != -1){
+		close(hck_fds[worker]);
+	}
+	hck_fds[worker] = -1;
+}
+
+// a target is always served by the same worker so that its keepalive connection is reused
+static int worker_for(const char* addr, const char* port){
+	if (config.workers == 1){
+		return 0;
+	}
+
+	return hck_hash(port, strlen(port), hck_hash(addr, strlen(addr) + 1)) % config.workers;
+}
 
-	assert(sizeof(buf.sa) + sizeof(buf.servinfo) == sizeof(buf));
+static uint32_t request_seq;
 
-	int required = sizeof(buf);
-	void* ptr = &buf;
+// item timeout set by the agent, seconds
+static int item_timeout;
+
+// when the request started now has to be answered by, ms on the monotonic clock. 0 for no deadline
+static uint64_t request_deadline(){
+	return item_timeout > 0 ? monotonic_ms() + item_timeout * 1000 : 0;
+}
+
+// wait for the worker socket to be ready, false with ETIMEDOUT once the deadline (0 for none) has passed
+static bool wait_fd(int fd, short events, uint64_t deadline){
+	struct pollfd p;
+	int rc, timeout;
+
+	p.fd = fd;
+	p.events = events;
 	do {
-		rc = recv(socket, ptr, required, MSG_WAITALL);
-		if (rc == -1 || rc == 0){
-			close(socket);
-			return;
+		timeout = -1;
+		if (deadline != 0){
+			uint64_t now = monotonic_ms();
+			if (now >= deadline){
+				errno = ETIMEDOUT;
+				return false;
+			}
+			timeout = (int)min(deadline - now, (uint64_t)INT_MAX);
+		}
+		rc = poll(&p, 1, timeout);
+	} while (rc == 0 || (rc == -1 && errno == EINTR));
+
+	return rc > 0;
+}
+
+static bool send_frame(int fd, uint8_t type, uint32_t id, const void* payload, uint16_t length, uint64_t deadline = 0){
+	char buf[sizeof(struct hck_frame) + HCK_MAX_PAYLOAD];
+	struct hck_frame f;
+	size_t sent = 0;
+	int rc;
+
+	assert(length <= HCK_MAX_PAYLOAD);
+
+	f.version = HCK_PROTOCOL_VERSION;
+	f.type = type;
+	f.length = length;
+	f.id = id;
+	memcpy(buf, &f, sizeof(f));
+	memcpy(buf + sizeof(f), payload, length);
+
+	while (sent < sizeof(f) + length){
+		rc = send(fd, buf + sent, sizeof(f) + length - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (rc == -1){
+			if ((errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) || !wait_fd(fd, POLLOUT, deadline)){
+				return false;
+			}
+			continue;
+		}
+		sent += rc;
+	}
+	return true;
+}
+
+static bool recv_all(int fd, void* ptr, size_t required, uint64_t deadline = 0){
+	int rc;
+
+	while (required){
+		rc = recv(fd, ptr, required, MSG_DONTWAIT);
+		if (rc == 0){
+			perror("socket shutdown, no more data");
+			return false;
+		}
+		if (rc == -1){
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+				if (!wait_fd(fd, POLLIN, deadline)){
+					return false;
+				}
+				continue;
+			}
+			perror("io error during recv");
+			return false;
 		}
-		ptr += rc;
 		required -= rc;
-	} while (required);
+		ptr = (char*)ptr + rc;
+	}
+
+	return true;
+}
 
-	int sa_zero = sizeof(buf.sa) - buf.servinfo.ai_addrlen;
-	assert(sa_zero >= 0);
-	if (sa_zero != 0){
-		//clear end of struct for when doing memcmp lookup
-		memset(&buf.sa + sa_zero, 0, sa_zero);
+// read the next frame, the payload must fit in max bytes
+static bool recv_frame(int fd, struct hck_frame* f, void* payload, size_t max, uint64_t deadline = 0){
+	if (!recv_all(fd, f, sizeof(*f), deadline)){
+		return false;
 	}
+	if (f->version != HCK_PROTOCOL_VERSION || f->length > max){
+		return false;
+	}
+	return recv_all(fd, payload, f->length, deadline);
+}
 
-	if (!check_add(&hck, buf.servinfo, buf.sa, now, socket)){
-		//close on error
-		close(socket);
+// pack NUL terminated fields into a request payload, NULL fields are sent empty. False if they do not fit
+static bool payload_pack(char* payload, size_t* len, const char* const* fields, int n){
+	*len = 0;
+	for (int i = 0; i < n; i++){
+		const char* s = fields[i] != NULL ? fields[i] : "";
+		size_t l = strlen(s) + 1;
+		if (*len + l > HCK_MAX_PAYLOAD){
+			return false;
+		}
+		memcpy(payload + *len, s, l);
+		*len += l;
 	}
+	return true;
 }
 
-void handle_cleanup(hck_handle& hck, time_t now){
-	struct hck_details* h;
-	std::vector<int> to_delete;
+/*
+Send a request to a worker and wait for its reply, HCK_RESULT_OK once it is in f
+and reply. Past the deadline (0 for none) the connection is dropped, a reply
+could still be on its way, and the next request connects again.
+*/
+static unsigned short worker_request(int worker, uint8_t type, const char* payload, size_t len,
+	uint8_t reply_type, struct hck_frame* f, char* reply, uint64_t deadline){
+	int fd;
+	uint32_t id;
 
-	for (map<int, struct hck_details*>::iterator it = hck.sockets.begin(); it != hck.sockets.end(); it++){
-		h = it->second;
-		if (h->expires < now){
-			to_delete.push_back(it->first);
+	fd = worker_fd(worker);
+	if (fd == -1){
+		return HCK_RESULT_NO_WORKER;
+	}
 
-			zabbix_log(LOG_LEVEL_WARNING, "Expiring socket %d in state %d", h->remote_socket, h->state);
+	id = ++request_seq;
+	if (!send_frame(fd, type, id, payload, len, deadline)){
+		if (errno != ETIMEDOUT){
+			perror("io error during send");
 		}
+		worker_reset(worker);
+		return errno == ETIMEDOUT ? HCK_RESULT_TIMEOUT : HCK_RESULT_ERROR;
 	}
-	for (std::vector<int>::iterator it = to_delete.begin(); it != to_delete.end(); it++){
-		int idx = *it;
-		h = hck.sockets[*it];
 
-		if (h->state != hck_details::keepalive){
-			send_result(&hck, h->client_socket, false);
+	/* Replies to earlier, abandoned requests are skipped */
+	do {
+		if (!recv_frame(fd, f, reply, HCK_MAX_PAYLOAD, deadline)){
+			worker_reset(worker);
+			return errno == ETIMEDOUT ? HCK_RESULT_TIMEOUT : HCK_RESULT_ERROR;
 		}
-		
-		int erased = hck.sockets.erase(idx);
-		assert(erased == 1);
+	} while (f->id != id);
 
-		close(h->client_socket);
-		close(h->remote_socket);
-		delete h;
+	if (f->type != reply_type){
+		worker_reset(worker);
+		return HCK_RESULT_ERROR;
 	}
+	return HCK_RESULT_OK;
 }
 
-int create_listener(){
-	int fd;
-	struct sockaddr_un addr;
+// method, path and host are optional, NULL or empty for the defaults. interval (seconds) registers how often the item is polled
+unsigned short execute_check(const char* addr, const char* port, const char* method = NULL, const char* path = NULL, const char* host = NULL,
+	const char* interval = NULL){
+	uint16_t result;
+	unsigned short rc;
+	size_t len;
+	struct hck_frame f;
+	char payload[HCK_MAX_PAYLOAD];
+	char budget[16] = "";
+	char interval_ms[16] = "";
+	const char* fields[7] = { addr, port, method, path, host, budget, interval_ms };
+	uint64_t deadline = request_deadline();
+	int n;
 
-	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-		perror("socket error");
-		return -1;
+	if (addr == NULL || port == NULL || *addr == 0){
+		return HCK_RESULT_ERROR;
 	}
 
-	memset(&addr, 0, sizeof(addr));
-	addr.sun_family = AF_UNIX;
-	zbx_strlcpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	/* The worker gives up a little before the poller does, so that a slow target is a FAIL rather than a timeout */
+	if (deadline != 0){
+		snprintf(budget, sizeof(budget), "%d", item_timeout * 900);
+	}
 
-	unlink(socket_path);
+	if (interval != NULL && *interval != 0){
+		if (atoi(interval) <= 0){
+			return HCK_RESULT_ERROR;
+		}
+		snprintf(interval_ms, sizeof(interval_ms), "%d", min(atoi(interval), INT_MAX / 1000) * 1000);
+	}
 
-	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-		perror("bind error");
-		return -1;
+	/* Resolution is left to the worker, send the name as given, and the request only if it is not the default */
+	n = *interval_ms != 0 ? 7 : deadline != 0 ? 6 : (method != NULL && *method != 0) || (path != NULL && *path != 0) || (host != NULL && *host != 0) ? 5 : 2;
+	if (!payload_pack(payload, &len, fields, n)){
+		return HCK_RESULT_ERROR;
 	}
 
-	if (listen(fd, 5) == -1) {
-		perror("listen error");
-		return -1;
+	rc = worker_request(worker_for(addr, port), HCK_MSG_CHECK, payload, len, HCK_MSG_RESULT, &f, payload, deadline);
+	if (rc != HCK_RESULT_OK){
+		return rc;
 	}
+	if (f.length != sizeof(result)){
+		return HCK_RESULT_ERROR;
+	}
+	memcpy(&result, payload, sizeof(result));
 
-	return fd;
+	return result;
 }
 
-bool set_blocking_mode(const int &socket, bool is_blocking)
-{
-	bool ret = true;
-
-	const int flags = fcntl(socket, F_GETFL, 0);
-	ret = 0 == fcntl(socket, F_SETFL, is_blocking ? (flags ^ O_NONBLOCK) : (flags | O_NONBLOCK));	
+// split "host:port" or "[address]:port" in place, port 80 if there is none. False if it can not be
+static bool target_split(char* target, const char** host, const char** port){
+	char* colon;
 
-	return ret;
+	*port = "80";
+	if (*target == '['){
+		char* close = strchr(target, ']');
+		if (close == NULL || (close[1] != 0 && close[1] != ':')){
+			return false;
+		}
+		*close = 0;
+		*host = target + 1;
+		if (close[1] == ':'){
+			*port = close + 2;
+		}
+	}
+	else{
+		*host = target;
+		colon = strrchr(target, ':');
+		if (colon != NULL){
+			/* An IPv6 address needs its brackets to be given a port */
+			if (strchr(target, ':') != colon){
+				return **host != 0;
+			}
+			*colon = 0;
+			*port = colon + 1;
+		}
+	}
+	return **host != 0 && **port != 0;
 }
 
+// the targets of a bulk check going to a worker in one frame
+struct hck_bulk_frame {
+	int worker;
+	uint32_t id;
+	size_t len;	// of the payload so far
+	vector<const char*> fields;
+	vector<int> indexes;
+	bool pending;	// sent, not answered yet
+};
+
 /*
-Main loop for processing check requests
+Check many targets in one round trip to each worker: the targets are sent to
+their workers all at once, then the replies are gathered. A worker's targets
+go in as many frames as HCK_MAX_PAYLOAD takes, answered in any order. results
+gets one of hck_result per target, targets whose worker does not answer in
+time FAIL, and a target that can not be parsed or does not fit a frame is
+HCK_RESULT_ERROR while the others are still checked. HCK_RESULT_NO_WORKER if
+a worker can not be reached.
 */
-void main_thread(){
-	int n;
-	hck_handle hck;
-	time_t now;
-	time_t lasttime;
-	int fd;
-
-	struct epoll_event events[MAXEVENTS];
-	struct epoll_event e;
-	struct hck_details* h;
+unsigned short execute_bulk(const char* const* targets, int count, uint16_t* results){
+	vector<string> names(count);
+	vector<struct hck_bulk_frame> frames;
+	int filling[HCK_MAX_WORKERS];
+	unsigned int pending[HCK_MAX_WORKERS] = { 0 };
+	bool failed[HCK_MAX_WORKERS] = { false };
+	char payload[HCK_MAX_PAYLOAD];
+	char budget[16] = "";
+	uint64_t deadline = request_deadline();
+	struct hck_frame f;
+	size_t len;
+
+	if (deadline != 0){
+		snprintf(budget, sizeof(budget), "%d", item_timeout * 900);
+	}
 
-	hck.epfd = epoll_create(1024);
-	localtime(&now);
-	
-	/* Create internal listener */
-	fd = create_listener();
-	if (fd == -1){
-		return;
+	for (int w = 0; w < HCK_MAX_WORKERS; w++){
+		filling[w] = -1;
 	}
 
-	/* Add the listener to EPOLL */
-	e.data.fd = fd;
-	e.events = EPOLLIN;
-	epoll_ctl(hck.epfd, EPOLL_CTL_ADD, fd, &e);
+	for (int i = 0; i < count; i++){
+		const char *host, *port;
+		size_t size;
+		int worker;
 
-	zabbix_log(LOG_LEVEL_WARNING, "Zabbix HCK Main thread started");
+		results[i] = HCK_RESULT_ERROR;
+		if (targets[i] == NULL){
+			continue;
+		}
+		names[i] = targets[i];
+		if (!target_split(&names[i][0], &host, &port)){
+			continue;
+		}
+		size = strlen(host) + strlen(port) + 2;
+		if (strlen(budget) + 1 + size > HCK_MAX_PAYLOAD){
+			continue;
+		}
+		worker = worker_for(host, port);
+
+		/* A frame takes the targets its payload and its reply have room for, then the next one starts */
+		if (filling[worker] == -1 || frames[filling[worker]].len + size > HCK_MAX_PAYLOAD ||
+			(frames[filling[worker]].indexes.size() + 1) * sizeof(uint16_t) > HCK_MAX_PAYLOAD){
+			struct hck_bulk_frame b;
+
+			b.worker = worker;
+			b.id = 0;
+			b.len = strlen(budget) + 1;
+			b.fields.push_back(budget);
+			b.pending = false;
+			filling[worker] = frames.size();
+			frames.push_back(b);
+		}
 
-	while (running){
-		/* Update timestamp once per loop */
-		time(&now);
+		struct hck_bulk_frame& b = frames[filling[worker]];
+		b.fields.push_back(host);
+		b.fields.push_back(port);
+		b.indexes.push_back(i);
+		b.len += size;
+		results[i] = HCK_RESULT_FAIL;
+	}
 
-		n = epoll_wait(hck.epfd, events, MAXEVENTS, 1000);
-		while (n > 0){
-			n--;
+	/* Every worker gets its targets before any reply is waited for */
+	for (size_t i = 0; i < frames.size(); i++){
+		struct hck_bulk_frame& b = frames[i];
+		int fd;
 
-			e = events[n];
+		/* A worker that failed a send has been reset, its other frames would go to a new connection and be lost */
+		if (failed[b.worker]){
+			continue;
+		}
+		if (!payload_pack(payload, &len, &b.fields[0], b.fields.size())){
+			return HCK_RESULT_ERROR;
+		}
+		fd = worker_fd(b.worker);
+		if (fd == -1){
+			return HCK_RESULT_NO_WORKER;
+		}
+		b.id = ++request_seq;
+		if (!send_frame(fd, HCK_MSG_BULK, b.id, payload, len, deadline)){
+			worker_reset(b.worker);
+			failed[b.worker] = true;
+			pending[b.worker] = 0;
+			continue;
+		}
+		b.pending = true;
+		pending[b.worker]++;
+	}
 
-			if (hck.sockets.find(e.data.fd) != hck.sockets.end()){ /* handle events for the checks */
-				handle_http(hck, e, now);
+	for (int w = 0; w < config.workers; w++){
+		/* Replies to earlier, abandoned requests are skipped, the frames of this one come in any order */
+		while (pending[w] != 0){
+			struct hck_bulk_frame* b = NULL;
+
+			if (!recv_frame(hck_fds[w], &f, payload, HCK_MAX_PAYLOAD, deadline)){
+				worker_reset(w);
+				break;
 			}
-			else if (e.data.fd == fd){ 
-				/* Handle new connections to the main thread */
-				if (e.events & EPOLLIN){
-					/* Accept & Add to EPOLL */
-					e.data.fd = accept(e.data.fd, 0, 0);
-					if (e.data.fd == -1){
-						zabbix_log(LOG_LEVEL_WARNING, "Unable to accept internal communication socket: %s", strerror(errno));
-						continue;
-					}
-					set_blocking_mode(e.data.fd, true);
-					epoll_ctl(hck.epfd, EPOLL_CTL_ADD, e.data.fd, &e);
-				}
-				else{
-					goto cleanup;
-					return;
+			for (size_t i = 0; i < frames.size() && b == NULL; i++){
+				if (frames[i].worker == w && frames[i].pending && frames[i].id == f.id){
+					b = &frames[i];
 				}
 			}
-			else{ /* handle events for a connection to the main thread */
-				if (e.events & EPOLLIN){
-					handle_internalsock(hck, e.data.fd, now);
-				}
-				else if (e.events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
-					zabbix_log(LOG_LEVEL_WARNING, "An error occured with client socket %d. Closing", e.data.fd);
-
-					//error
-					bool found = false;
-					for (map<int, struct hck_details*>::iterator it = hck.sockets.begin(); it != hck.sockets.end(); it++){
-						struct hck_details* h = it->second;
-						if (h->client_socket == e.data.fd){
-							assert(!found);//todo: add if debug break
-							h->client_socket = -1;
-							found = true;
-						}
-					}
-
-					/* is it not a client socket? */
-					if (!found){
-						zabbix_log(LOG_LEVEL_WARNING, "HCK: closing socket %d of unknown type\n", e.data.fd);
-					}
-
-					close(e.data.fd);
-				}
+			if (b == NULL){
+				continue;
 			}
-		}
 
-		if (now > lasttime){
-			lasttime = now;
-			handle_cleanup(hck, now);
+			if (f.type != HCK_MSG_RESULTS || f.length != b->indexes.size() * sizeof(uint16_t)){
+				worker_reset(w);
+				break;
+			}
+			for (size_t i = 0; i < b->indexes.size(); i++){
+				memcpy(&results[b->indexes[i]], payload + i * sizeof(uint16_t), sizeof(uint16_t));
+			}
+			b->pending = false;
+			pending[w]--;
 		}
 	}
 
-cleanup:
-	zabbix_log(LOG_LEVEL_WARNING, "Zabbix HCK cleanup");
+	return HCK_RESULT_OK;
+}
 
-	close(fd);
+/*
+The results of a bulk check as a JSON object, {"target":1,...} with the targets
+as given: null for those not checked as the worker was overloaded, "invalid"
+for those that could not be parsed.
+*/
+string bulk_json(const char* const* targets, const uint16_t* results, int count){
+	string json = "{";
 
-	//todo: remote socket & keepalive
-	for (map<int, struct hck_details*>::iterator it = hck.sockets.begin(); it != hck.sockets.end(); it++){
-		close(it->second->client_socket);
-		delete it->second;
+	for (int i = 0; i < count; i++){
+		if (i > 0){
+			json += ',';
+		}
+		json += '"';
+		for (const char* p = targets[i] != NULL ? targets[i] : ""; *p != 0; p++){
+			if (*p == '"' || *p == '\\'){
+				json += '\\';
+			}
+			if ((unsigned char)*p >= ' '){
+				json += *p;
+			}
+		}
+		json += "\":";
+		json += results[i] == HCK_RESULT_OK ? "1" : results[i] == HCK_RESULT_OVERLOADED ? "null" : results[i] == HCK_RESULT_ERROR ? "\"invalid\"" : "0";
 	}
-}
+	json += '}';
 
-unsigned short execute_check(int fd, const char* addr, const char* port, bool retry = true){
-	int rc;
-	unsigned short result;
-	struct addrinfo hints;
-	struct addrinfo *servinfo;  // will point to the results
-
-	memset(&hints, 0, sizeof hints); // make sure the struct is empty
-	memset(&servinfo, 0, sizeof servinfo); // make sure the struct is empty
+	return json;
+}
 
-	hints.ai_family = AF_UNSPEC;     // don't care IPv4 or IPv6
-	hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
-	hints.ai_flags = AI_PASSIVE;     // fill in my IP for me
+// latency of a phase in ns, HCK_RESULT_FAIL if it has not been measured
+unsigned short execute_latency(const char* addr, const char* port, const char* phase, const char* stat, const char* connection, uint64_t* ns){
+	unsigned short rc;
+	size_t len;
+	struct hck_frame f;
+	char payload[HCK_MAX_PAYLOAD];
+	const char* fields[5] = { addr, port, phase, stat, connection };
 
-	if ((rc = getaddrinfo(addr, port, &hints, &servinfo)) != 0) {
-		perror("get addr info failed");
-		return 4;
+	if (addr == NULL || port == NULL || *addr == 0 || !payload_pack(payload, &len, fields, 5)){
+		return HCK_RESULT_ERROR;
 	}
 
-	rc = send(fd, (void*)servinfo->ai_addr, sizeof(*servinfo->ai_addr), 0);
-	if (rc < 0){
-		freeaddrinfo(servinfo); // free the linked-list
-		perror("io error during send (1)");
-		return 4;
+	rc = worker_request(worker_for(addr, port), HCK_MSG_LATENCY, payload, len, HCK_MSG_VALUE, &f, payload, request_deadline());
+	if (rc != HCK_RESULT_OK){
+		return rc;
 	}
-
-	rc = send(fd, (void*)servinfo, sizeof(addrinfo), 0);
-	if (rc < 0){
-		freeaddrinfo(servinfo); // free the linked-list
-		perror("io error during send (2)");
-		return 4;
+	if (f.length != sizeof(*ns)){
+		return HCK_RESULT_FAIL;
 	}
-	freeaddrinfo(servinfo); // free the linked-list
+	memcpy(ns, payload, sizeof(*ns));
 
-	int required = sizeof(result);
-	void* ptr = &result;
-	do {
-		rc = recv(fd, ptr, required, MSG_WAITALL);
-		if (rc == 0){
-			perror("socket shutdown, no more data");
-			return 4;
-		}
-		if (rc == -1){
-			perror("io error during recv");
-			return 4;
-		}
-		required -= rc;
-		ptr += rc;
-	} while (required);
+	return HCK_RESULT_OK;
+}
 
-	if (result == 3){
-		if (!retry){
-			return 0;
+// a worker metric, summed over the workers unless one is given, numbered from 1. HCK_RESULT_FAIL for an unknown metric
+unsigned short execute_stats(const char* metric, const char* worker, uint64_t* value){
+	unsigned short rc;
+	size_t len;
+	struct hck_frame f;
+	char payload[HCK_MAX_PAYLOAD], reply[HCK_MAX_PAYLOAD];
+	uint64_t v, deadline = request_deadline();
+	int first = 0, last = config.workers - 1;
+
+	if (metric == NULL || *metric == 0 || !payload_pack(payload, &len, &metric, 1)){
+		return HCK_RESULT_ERROR;
+	}
+	if (worker != NULL && *worker != 0){
+		first = last = atoi(worker) - 1;
+		if (first < 0 || first >= config.workers){
+			return HCK_RESULT_ERROR;
 		}
+	}
 
-		//retry
-		return execute_check(fd, addr, port, false);
+	*value = 0;
+	for (int i = first; i <= last; i++){
+		rc = worker_request(i, HCK_MSG_STATS, payload, len, HCK_MSG_VALUE, &f, reply, deadline);
+		if (rc != HCK_RESULT_OK){
+			return rc;
+		}
+		if (f.length != sizeof(v)){
+			return HCK_RESULT_FAIL;
+		}
+		memcpy(&v, reply, sizeof(v));
+		*value += v;
 	}
 
-	return result;
+	return HCK_RESULT_OK;
 }
 
-int connect_to_hck(){
-	struct sockaddr_un addr;
-	int fd;
-
-	//create new unix socket
-	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-		perror("socket error");
-		return -1;
-	}
+void handle_sighup(int signal){
+	running = 0;
+}
 
-	//setup unix socket address
-	memset(&addr, 0, sizeof(addr));
-	addr.sun_family = AF_UNIX;
-	zbx_strlcpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+static void pin_worker(int worker){
+	cpu_set_t set;
+	int cpu;
 
-	//connect to unix socket
-	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-		perror("connect error");
-		close(fd);
-		return -1;
+	if (config.worker_cpus_count == 0){
+		return;
 	}
 
-	return fd;
-}
-
-void handle_sighup(int signal){
-	running = 0;
+	cpu = config.worker_cpus[worker % config.worker_cpus_count];
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) == -1){
+		zabbix_log(LOG_LEVEL_WARNING, "HCK: unable to pin worker #%d to cpu %d: %s", worker + 1, cpu, strerror(errno));
+	}
 }
 
-void processing_thread(){
+void processing_thread(int worker){
 	// Setup the sighup handler
 	struct sigaction sa;
 	sa.sa_handler = &handle_sighup;
@@ -836,15 +5079,21 @@ void processing_thread(){
 	// Send SIGHUP if parent exits
 	prctl(PR_SET_PDEATHSIG, SIGHUP);
 
-	// Run until then
+	pin_worker(worker);
+
+	// Run until then, waiting a little before starting again if the worker could not start
 	while (running){
-		main_thread();
+		main_thread(worker);
+		if (running){
+			sleep(1);
+		}
 	}
 
 	// As far as we go
 	exit(0);
 }
 
+#ifndef HCK_STANDALONE
 extern "C" {
 	/******************************************************************************
 	*                                                                            *
@@ -872,6 +5121,7 @@ extern "C" {
 	******************************************************************************/
 	void    zbx_module_item_timeout(int timeout)
 	{
+		item_timeout = timeout;
 	}
 
 	/******************************************************************************
@@ -888,40 +5138,61 @@ extern "C" {
 		return keys;
 	}
 
-	int hck_fd = -1;
-
 	int    zbx_module_hck_check(AGENT_REQUEST *request, AGENT_RESULT *result)
 	{
 		unsigned short res;
-		char *param1, *param2;
-		char buffer[1];
+		char *param1, *param2, *method, *path, *host, *interval, *end;
 
-		if (hck_fd == -1)
-		{
-			hck_fd = connect_to_hck();
+		param1 = get_rparam(request, 0);
+		param2 = get_rparam(request, 1);
+		method = get_rparam(request, 2);
+		path = get_rparam(request, 3);
+		host = get_rparam(request, 4);
+		interval = get_rparam(request, 5);
+
+		/* A bad item key is not a target down, 0 is kept for checks that ran */
+		if (param1 == NULL || *param1 == 0 || param2 == NULL || *param2 == 0){
+			SET_MSG_RESULT(result, strdup("Invalid address or port"));
+			return SYSINFO_RET_FAIL;
 		}
-		else if (send(hck_fd, &buffer, 0, 0) == -1)
-		{
-			close(hck_fd);
-			hck_fd = connect_to_hck();
+		if (method != NULL && *method != 0 && !http_token(method)){
+			SET_MSG_RESULT(result, strdup("Invalid method"));
+			return SYSINFO_RET_FAIL;
+		}
+		if (path != NULL && *path != 0 && (!http_token(path) || *path != '/')){
+			SET_MSG_RESULT(result, strdup("Invalid path, expected one starting with /"));
+			return SYSINFO_RET_FAIL;
+		}
+		if (host != NULL && *host != 0 && !http_token(host)){
+			SET_MSG_RESULT(result, strdup("Invalid Host header"));
+			return SYSINFO_RET_FAIL;
+		}
+		if (interval != NULL && *interval != 0 && (strtol(interval, &end, 10) <= 0 || *end != 0)){
+			SET_MSG_RESULT(result, strdup("Invalid interval, expected a number of seconds above 0"));
+			return SYSINFO_RET_FAIL;
 		}
 
-		if (hck_fd == -1){
-			SET_MSG_RESULT(result, strdup("Unable to connect to worker process"));
+		/* The budget and interval go along with the strings, each with its NUL */
+		if (strlen(param1) + strlen(param2) + (method != NULL ? strlen(method) : 0) + (path != NULL ? strlen(path) : 0) +
+			(host != NULL ? strlen(host) : 0) + 2 * 16 + 7 > HCK_MAX_PAYLOAD){
+			SET_MSG_RESULT(result, strdup("Invalid parameters, too long for a check request"));
 			return SYSINFO_RET_FAIL;
 		}
 
-		param1 = get_rparam(request, 0);
-		param2 = get_rparam(request, 1);
+		res = execute_check(param1, param2, method, path, host, interval);
 
-		res = execute_check(hck_fd, param1, param2);
+		if (res == HCK_RESULT_NO_WORKER){
+			SET_MSG_RESULT(result, strdup("Unable to connect to worker process"));
+			return SYSINFO_RET_FAIL;
+		}
+		if (res == HCK_RESULT_OVERLOADED){
+			SET_MSG_RESULT(result, strdup("Worker process overloaded, no connection available"));
+			return SYSINFO_RET_FAIL;
+		}
 
 		//an error occured
-		if (res > 1){
-			close(hck_fd);
-			hck_fd = -1;
-
-			res = 0;
+		if (res != HCK_RESULT_OK){
+			res = HCK_RESULT_FAIL;
 		}
 
 		SET_UI64_RESULT(result, res);
@@ -929,6 +5200,117 @@ extern "C" {
 		return SYSINFO_RET_OK;
 	}
 
+	int    zbx_module_hck_latency(AGENT_REQUEST *request, AGENT_RESULT *result)
+	{
+		unsigned short res;
+		char *phase, *stat, *connection;
+		uint64_t ns;
+		double q;
+
+		phase = get_rparam(request, 2);
+		stat = get_rparam(request, 3);
+		connection = get_rparam(request, 4);
+
+		if (latency_phase(phase) == -1){
+			SET_MSG_RESULT(result, strdup("Invalid phase, expected connect, write, firstbyte or header"));
+			return SYSINFO_RET_FAIL;
+		}
+		if (!latency_stat(stat, &q)){
+			SET_MSG_RESULT(result, strdup("Invalid statistic, expected last or pN"));
+			return SYSINFO_RET_FAIL;
+		}
+		if (latency_kind(connection) == -1){
+			SET_MSG_RESULT(result, strdup("Invalid connection, expected all, new or reused"));
+			return SYSINFO_RET_FAIL;
+		}
+
+		res = execute_latency(get_rparam(request, 0), get_rparam(request, 1), phase, stat, connection, &ns);
+
+		if (res == HCK_RESULT_NO_WORKER){
+			SET_MSG_RESULT(result, strdup("Unable to connect to worker process"));
+			return SYSINFO_RET_FAIL;
+		}
+		if (res == HCK_RESULT_TIMEOUT){
+			SET_MSG_RESULT(result, strdup("Timed out waiting for worker process"));
+			return SYSINFO_RET_FAIL;
+		}
+		if (res == HCK_RESULT_FAIL){
+			SET_MSG_RESULT(result, strdup("No latency measured for this target yet"));
+			return SYSINFO_RET_FAIL;
+		}
+		if (res != HCK_RESULT_OK){
+			SET_MSG_RESULT(result, strdup("Unable to get latency from worker process"));
+			return SYSINFO_RET_FAIL;
+		}
+
+		/* Seconds, like the agent's own response time items */
+		SET_DBL_RESULT(result, ns / 1e9);
+
+		return SYSINFO_RET_OK;
+	}
+
+	int    zbx_module_hck_stats(AGENT_REQUEST *request, AGENT_RESULT *result)
+	{
+		unsigned short res;
+		uint64_t value;
+
+		res = execute_stats(get_rparam(request, 0), get_rparam(request, 1), &value);
+
+		if (res == HCK_RESULT_NO_WORKER){
+			SET_MSG_RESULT(result, strdup("Unable to connect to worker process"));
+			return SYSINFO_RET_FAIL;
+		}
+		if (res == HCK_RESULT_TIMEOUT){
+			SET_MSG_RESULT(result, strdup("Timed out waiting for worker process"));
+			return SYSINFO_RET_FAIL;
+		}
+		if (res == HCK_RESULT_FAIL){
+			SET_MSG_RESULT(result, strdup("Unknown metric"));
+			return SYSINFO_RET_FAIL;
+		}
+		if (res != HCK_RESULT_OK){
+			SET_MSG_RESULT(result, strdup("Invalid metric or worker, or unable to get stats from worker process"));
+			return SYSINFO_RET_FAIL;
+		}
+
+		SET_UI64_RESULT(result, value);
+
+		return SYSINFO_RET_OK;
+	}
+
+	int    zbx_module_hck_check_bulk(AGENT_REQUEST *request, AGENT_RESULT *result)
+	{
+		unsigned short res;
+		vector<const char*> targets;
+		vector<uint16_t> results;
+		string json;
+
+		for (int i = 0; i < request->nparam; i++){
+			targets.push_back(get_rparam(request, i));
+		}
+		if (targets.empty()){
+			SET_MSG_RESULT(result, strdup("No targets given"));
+			return SYSINFO_RET_FAIL;
+		}
+		results.resize(targets.size());
+
+		res = execute_bulk(&targets[0], targets.size(), &results[0]);
+
+		if (res == HCK_RESULT_NO_WORKER){
+			SET_MSG_RESULT(result, strdup("Unable to connect to worker process"));
+			return SYSINFO_RET_FAIL;
+		}
+		if (res != HCK_RESULT_OK){
+			SET_MSG_RESULT(result, strdup("Unable to check the targets"));
+			return SYSINFO_RET_FAIL;
+		}
+
+		json = bulk_json(&targets[0], &results[0], targets.size());
+		SET_TEXT_RESULT(result, strdup(json.c_str()));
+
+		return SYSINFO_RET_OK;
+	}
+
 	/******************************************************************************
 	*                                                                            *
 	* Function: zbx_module_init                                                  *
@@ -944,10 +5326,23 @@ extern "C" {
 	******************************************************************************/
 	int    zbx_module_init()
 	{
-		if (fork() == 0){
-			zbx_setproctitle("zabbix_proxy: http check keepalive #1");
-			processing_thread();
-			exit(1);
+		load_config(getenv("HCK_CONFIG") != NULL ? getenv("HCK_CONFIG") : config_path);
+
+		for (int i = 0; i < HCK_MAX_WORKERS; i++){
+			hck_fds[i] = -1;
+		}
+
+		/* The workers of hck_daemon are shared by every process loading the module */
+		if (config.daemon){
+			return ZBX_MODULE_OK;
+		}
+
+		for (int i = 0; i < config.workers; i++){
+			if (fork() == 0){
+				zbx_setproctitle("zabbix_proxy: http check keepalive #%d", i + 1);
+				processing_thread(i);
+				exit(1);
+			}
 		}
 
 		return ZBX_MODULE_OK;
@@ -968,4 +5363,5 @@ extern "C" {
 	{
 		return ZBX_MODULE_OK;
 	}
-}
\ No newline at end of file
+}
+#endif